@@ -0,0 +1,250 @@
+/*****************************************************************************
+
+	avlbench.c - Benchmark program for libavl
+
+	Copyright (c) 2000-2009  Wessel Dankers <wsl@fruit.je>
+
+	This file is part of libavl.
+
+	libavl is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as
+	published by the Free Software Foundation, either version 3 of
+	the License, or (at your option) any later version.
+
+	libavl is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	and a copy of the GNU Lesser General Public License along with
+	libavl.  If not, see <http://www.gnu.org/licenses/>.
+
+*****************************************************************************/
+
+/* Runs a couple of workloads against a tree and reports the time per
+ * operation and the resulting tree height. Build it against a library
+ * compiled with -DAVL_COUNT (or configured with --enable-weight-balance)
+ * to compare weight balancing against depth balancing; the avlbench_wb
+ * program does exactly that.
+ *
+ * The optional second argument picks where the nodes come from: malloc
+ * (the default), arena (an arena allocator with normal pages) or huge
+ * (an arena backed by huge pages, if it can get them). Use 10000000
+ * nodes or more to see the effect of huge pages on searches. With an
+ * arena, the nodes are compacted into a fresh one after a round of
+ * churn, to show what avl_compact_step() does for locality. */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "avl.h"
+
+static unsigned long rng_state = 88172645463325252UL;
+
+static unsigned long rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static int key_cmp(const void *a, const void *b, void *userdata) {
+	return AVL_CMP(*(const unsigned long *)a, *(const unsigned long *)b);
+}
+
+static unsigned long key_hash(const void *a, void *userdata) {
+	return *(const unsigned long *)a;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int height(const avl_node_t *node) {
+	int l, r;
+	if(!node)
+		return 0;
+	l = height(node->left);
+	r = height(node->right);
+	return (l > r ? l : r) + 1;
+}
+
+static double start;
+
+static void report(const char *what, unsigned long ops, const avl_tree_t *tree) {
+	double elapsed = now() - start;
+	printf("%-20s %8.1f ns/op  height %d\n", what, elapsed * 1e9 / ops, height(tree->top));
+	start = now();
+}
+
+static void shuffle(unsigned long *a, unsigned long n) {
+	unsigned long i, j, t;
+	for(i = n; i > 1; i--) {
+		j = rng() % i;
+		t = a[i - 1];
+		a[i - 1] = a[j];
+		a[j] = t;
+	}
+}
+
+int main(int argc, char **argv) {
+	avl_tree_t tree = AVL_TREE_INITIALIZER(key_cmp, NULL);
+	unsigned long n, i, *keys, *order;
+	unsigned long found = 0;
+	const char *alloc;
+	avl_allocator_t *arena;
+	avl_compact_t compact;
+	avl_node_t *node;
+	int pages, want = 0;
+
+	n = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000UL;
+	alloc = argc > 2 ? argv[2] : "malloc";
+
+	if(!strcmp(alloc, "arena") || !strcmp(alloc, "huge")) {
+		want = strcmp(alloc, "huge") ? 0 : AVL_ARENA_HUGE;
+		tree.allocator = avl_arena_allocator_new(want);
+		if(!tree.allocator) {
+			perror("avl_arena_allocator_new()");
+			exit(2);
+		}
+	} else if(strcmp(alloc, "malloc")) {
+		fprintf(stderr, "unknown allocator: %s\n", alloc);
+		exit(2);
+	}
+
+	keys = malloc(n * sizeof *keys);
+	order = malloc(n * sizeof *order);
+	if(!keys || !order) {
+		perror("malloc()");
+		exit(2);
+	}
+
+#	if defined(AVL_DEPTH) && defined(AVL_COUNT)
+	printf("balancing on depth (with counts), ");
+#	elif defined(AVL_DEPTH)
+	printf("balancing on depth, ");
+#	else
+	printf("balancing on weight, ");
+#	endif
+	printf("%lu nodes of %lu bytes from %s\n", n, (unsigned long)sizeof(avl_node_t), alloc);
+
+	for(i = 0; i < n; i++) {
+		keys[i] = rng();
+		order[i] = i;
+	}
+
+	start = now();
+	for(i = 0; i < n; i++)
+		avl_item_insert(&tree, &keys[i]);
+	report("random insert", n, &tree);
+
+	if(tree.allocator) {
+		pages = avl_arena_allocator_pages(tree.allocator);
+		printf("arena pages:%s%s%s\n",
+			pages & AVL_ARENA_HUGETLB ? " hugetlb" : "",
+			pages & AVL_ARENA_THP ? " thp" : "",
+			pages & AVL_ARENA_NORMAL ? " normal" : "");
+		start = now();
+	}
+
+	shuffle(order, n);
+	start = now();
+	for(i = 0; i < n; i++)
+		found += !!avl_search(&tree, &keys[order[i]]);
+	report("random search", n, &tree);
+
+	if(avl_tree_hash_index(&tree, key_hash)) {
+		perror("avl_tree_hash_index()");
+		exit(2);
+	}
+	start = now();
+	for(i = 0; i < n; i++)
+		found += !!avl_search(&tree, &keys[order[i]]);
+	report("hashed search", n, &tree);
+	avl_tree_hash_index(&tree, NULL);
+	start = now();
+
+#	ifdef AVL_COUNT
+	for(i = 0; i < n; i++)
+		found += !!avl_at(&tree, rng() % n);
+	report("random avl_at", n, &tree);
+#	endif
+
+	for(i = 0; i < n; i++)
+		avl_item_delete(&tree, &keys[order[i]]);
+	report("random delete", n, &tree);
+
+	for(i = 0; i < n; i++)
+		keys[i] = i;
+	start = now();
+	for(i = 0; i < n; i++)
+		avl_item_insert(&tree, &keys[i]);
+	report("sequential insert", n, &tree);
+
+	for(i = 0; i < n; i++)
+		avl_delete(&tree, tree.head);
+	report("delete from head", n, &tree);
+
+	for(i = 0; i < n; i++)
+		avl_item_insert(&tree, &keys[i & 1 ? n - 1 - i / 2 : i / 2]);
+	report("zigzag insert", n, &tree);
+
+	for(i = 0; i < n; i++)
+		found += !!avl_search(&tree, &keys[rng() % n]);
+	report("random search", n, &tree);
+
+	/* Take out half of the nodes and put them back, so that they are
+	 * scattered over memory. */
+	shuffle(order, n);
+	for(i = 0; i < n / 2; i++)
+		avl_item_delete(&tree, &keys[order[i]]);
+	for(i = 0; i < n / 2; i++)
+		avl_item_insert(&tree, &keys[order[i]]);
+	report("churn", n, &tree);
+
+	for(node = tree.head; node; node = avl_next(node))
+		found += !!node->item;
+	report("in-order walk", n, &tree);
+
+	if(tree.allocator) {
+		arena = avl_arena_allocator_new(want);
+		if(!arena || !avl_compact_init(&compact, &tree, arena)) {
+			perror("avl_compact_init()");
+			exit(2);
+		}
+		start = now();
+		while(avl_compact_step(&compact, 1024) > 0)
+			;
+		if(!compact.done) {
+			perror("avl_compact_step()");
+			exit(2);
+		}
+		report("compact", n, &tree);
+		avl_arena_allocator_free(compact.from);
+
+		for(node = tree.head; node; node = avl_next(node))
+			found += !!node->item;
+		report("in-order walk", n, &tree);
+
+		for(i = 0; i < n; i++)
+			found += !!avl_search(&tree, &keys[rng() % n]);
+		report("random search", n, &tree);
+	}
+
+	avl_tree_purge(&tree);
+	avl_arena_allocator_free(tree.allocator);
+
+	fprintf(stderr, "(%lu lookups succeeded)\n", found);
+
+	free(order);
+	free(keys);
+
+	return 0;
+}
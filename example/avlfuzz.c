@@ -0,0 +1,890 @@
+/*****************************************************************************
+
+	avlfuzz.c - Differential fuzzer for libavl
+
+	Copyright (c) 2000-2009  Wessel Dankers <wsl@fruit.je>
+
+	This file is part of libavl.
+
+	libavl is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as
+	published by the Free Software Foundation, either version 3 of
+	the License, or (at your option) any later version.
+
+	libavl is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	and a copy of the GNU Lesser General Public License along with
+	libavl.  If not, see <http://www.gnu.org/licenses/>.
+
+	Interprets its input as a sequence of operations on a tree and on
+	a sorted array that serves as the reference. After every operation
+	the tree is checked with avl_tree_verify() and its contents are
+	compared with the array. Any difference aborts the program.
+
+	Without arguments it runs random inputs (avlfuzz [-s seed] [-n runs]),
+	otherwise it runs the files named on the command line, such as
+	crashes found by libFuzzer. In the example directory:
+
+	make avlfuzz_asan                   (address and UB sanitizers)
+	make avlfuzz_libfuzzer CC=clang     (libFuzzer, with sanitizers)
+	./avlfuzz_libfuzzer corpus/
+
+	Both build the library sources along with this program, so they can
+	be built for other tree modes by adding to CPPFLAGS, for example
+	make avlfuzz_asan CPPFLAGS=-DAVL_COUNT (weight balanced trees).
+
+*****************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sysexits.h>
+
+#include "avl.h"
+
+#define REF_MAX 4096
+
+/* Items are pointers into this array, so that they are never NULL and
+ * their value is the offset. */
+static const char values[256];
+
+static unsigned char ref[REF_MAX];
+static unsigned long refn;
+
+static const unsigned char *input, *input_end;
+static unsigned long step;
+
+static int next_byte(void) {
+	return input < input_end ? *input++ : 0;
+}
+
+static const void *item_of(int v) {
+	return values + v;
+}
+
+static int value_of(const void *item) {
+	return (const char *)item - values;
+}
+
+static int value_cmp(const void *a, const void *b, void *userdata) {
+	return AVL_CMP(value_of(a), value_of(b));
+}
+
+static int value_cmp_reverse(const void *a, const void *b, void *userdata) {
+	return AVL_CMP(value_of(b), value_of(a));
+}
+
+/* Keeps the values that are not a multiple of *userdata + 2. */
+static int value_keep(const void *item, void *userdata) {
+	return value_of(item) % (*(int *)userdata + 2) != 0;
+}
+
+static unsigned long value_hash(const void *item, void *userdata) {
+	return value_of(item);
+}
+
+static void fail(const char *what) {
+	fprintf(stderr, "avlfuzz: %s after step %lu\n", what, step);
+	abort();
+}
+
+/* Whether no two nodes hold equal items, as avl_tree_diff() and
+ * avl_log_dump() need. */
+static int unique(const avl_tree_t *tree) {
+	const avl_node_t *node, *next;
+
+	for(node = tree->head; node && (next = avl_next(node)); node = next)
+		if(value_of(node->item) == value_of(next->item))
+			return 0;
+	return 1;
+}
+
+static int apply_delta(const void *item, unsigned long n, void *userdata) {
+	return avl_delta_apply(userdata, item, n);
+}
+
+#ifdef AVL_MERKLE
+/* Differences reported by avl_tree_diff(), which must all be items on
+ * one side, in order. */
+typedef struct diffs {
+	unsigned long n;
+	int last;
+	int side;
+} diffs_t;
+
+static int count_diff(const void *a, const void *b, void *userdata) {
+	diffs_t *d = userdata;
+	const void *item = d->side ? b : a;
+
+	if(!item || (d->side ? a : b))
+		fail("avl_tree_diff() reported the wrong side");
+	if(value_of(item) < d->last)
+		fail("avl_tree_diff() reported out of order");
+	d->last = value_of(item);
+	d->n++;
+	return 0;
+}
+#endif
+
+static unsigned long node_mult(const avl_node_t *node) {
+#ifdef AVL_MULTISET
+	return node->multiplicity;
+#else
+	return 1;
+#endif
+}
+
+static unsigned long tree_count(const avl_tree_t *tree) {
+#ifdef AVL_COUNT
+	return avl_count(tree);
+#else
+	const avl_node_t *node;
+	unsigned long n = 0;
+
+	for(node = tree->head; node; node = avl_next(node))
+		n += node_mult(node);
+	return n;
+#endif
+}
+
+/* The node that holds the copy of an item at rank i. */
+static avl_node_t *node_at(const avl_tree_t *tree, unsigned long i) {
+#ifdef AVL_COUNT
+	avl_node_t *node;
+
+	node = avl_at(tree, i);
+	if(node && (avl_index(node) > i || avl_index(node) + node_mult(node) <= i))
+		fail("avl_index() does not match avl_at()");
+	return node;
+#else
+	avl_node_t *node;
+
+	for(node = tree->head; node && i >= node_mult(node); node = avl_next(node))
+		i -= node_mult(node);
+	return node;
+#endif
+}
+
+/* Rank of the first copy of v in the reference (or where it would go). */
+static unsigned long ref_lower(int v) {
+	unsigned long i;
+
+	for(i = 0; i < refn && ref[i] < v; i++);
+	return i;
+}
+
+/* Rank after the last copy of v in the reference. */
+static unsigned long ref_upper(int v) {
+	unsigned long i;
+
+	for(i = ref_lower(v); i < refn && ref[i] == v; i++);
+	return i;
+}
+
+static void ref_insert(int v, unsigned long n) {
+	unsigned long i;
+
+	if(refn + n > REF_MAX)
+		fail("reference overflow");
+	i = ref_upper(v);
+	memmove(ref + i + n, ref + i, refn - i);
+	memset(ref + i, v, n);
+	refn += n;
+}
+
+static void ref_remove(int v, unsigned long n) {
+	unsigned long i;
+
+	i = ref_lower(v);
+	if(n > ref_upper(v) - i)
+		fail("removed more copies than there were");
+	memmove(ref + i, ref + i + n, refn - i - n);
+	refn -= n;
+}
+
+static void check(const avl_tree_t *tree) {
+	const avl_node_t *node;
+	unsigned long i, m;
+
+	if(avl_tree_verify(tree))
+		fail("avl_tree_verify() failed");
+
+	i = 0;
+	for(node = tree->head; node; node = avl_next(node)) {
+		for(m = node_mult(node); m; m--, i++)
+			if(i >= refn || value_of(node->item) != ref[i])
+				fail("contents differ from the reference");
+	}
+	if(i != refn || tree_count(tree) != refn)
+		fail("size differs from the reference");
+}
+
+/* Walks a cursor over the nodes from rank i up to (not including) end,
+ * forward or back, in batches or one at a time, comparing them with the
+ * reference. */
+static void check_walk(avl_cursor_t *cursor, avl_node_t *node, unsigned long i, unsigned long end, int back, int batch) {
+	void *items[5];
+	size_t got, j;
+
+	if(batch) {
+		/* Follow along with the node, for its multiplicity. */
+		while((got = back ? avl_cursor_fetch_back(cursor, items, 5) : avl_cursor_fetch(cursor, items, 5))) {
+			for(j = 0; j < got; j++) {
+				if(i == end || !node || items[j] != node->item || value_of(items[j]) != ref[back ? end - 1 : i])
+					fail("avl_cursor_fetch() disagrees with the reference");
+				if(back)
+					end -= node_mult(node);
+				else
+					i += node_mult(node);
+				node = back ? avl_prev(node) : avl_next(node);
+			}
+		}
+	} else {
+		for(; node; node = back ? avl_cursor_prev(cursor) : avl_cursor_next(cursor)) {
+			if(i == end || value_of(node->item) != ref[back ? end - 1 : i])
+				fail("avl_cursor_next() disagrees with the reference");
+			if(back)
+				end -= node_mult(node);
+			else
+				i += node_mult(node);
+		}
+	}
+	if(i != end)
+		fail("cursor stopped early");
+}
+
+/* Checks a cursor over [lo, hi] and seeks to s against the reference. */
+static void check_cursor(const avl_tree_t *tree, int lo, int hi, int s, int how) {
+	avl_cursor_t cursor;
+	avl_node_t *node;
+	unsigned long a, b, i;
+
+	avl_cursor_init(&cursor, tree, how % 3);
+	node = avl_cursor_range(&cursor, item_of(lo), item_of(hi));
+	a = ref_lower(lo);
+	b = lo <= hi ? ref_upper(hi) : a;
+	if(b < a)
+		b = a;
+	if(!node != (a == b))
+		fail("avl_cursor_range() disagrees on emptiness");
+	check_walk(&cursor, node, a, b, 0, how & 4);
+
+	/* Leftmost node of the first item at least s, within the range. */
+	(void)avl_cursor_range(&cursor, item_of(lo), item_of(hi));
+	node = avl_cursor_seek_left(&cursor, item_of(s));
+	i = ref_lower(s);
+	if(i < a)
+		i = a;
+	if(!node != (i >= b))
+		fail("avl_cursor_seek_left() disagrees on presence");
+	if(node) {
+		if(value_of(node->item) != ref[i] || (avl_prev(node) && value_of(avl_prev(node)->item) == ref[i]))
+			fail("avl_cursor_seek_left() found the wrong node");
+		check_walk(&cursor, node, i, b, 0, how & 8);
+	}
+
+	/* Rightmost node of the last item at most s, within the range. */
+	(void)avl_cursor_range(&cursor, item_of(lo), item_of(hi));
+	node = avl_cursor_seek_right(&cursor, item_of(s));
+	i = ref_upper(s);
+	if(i > b)
+		i = b;
+	if(!node != (i <= a))
+		fail("avl_cursor_seek_right() disagrees on presence");
+	if(node) {
+		if(value_of(node->item) != ref[i - 1] || (avl_next(node) && value_of(avl_next(node)->item) == ref[i - 1]))
+			fail("avl_cursor_seek_right() found the wrong node");
+		check_walk(&cursor, node, a, i, 1, how & 16);
+	}
+}
+
+#if AVL_HAVE_POSIX
+#define TIMERS 8
+
+/* The reference for a timer: deadlines are in half seconds, and timers
+ * with equal deadlines expire in the order in which they were armed. */
+typedef struct timer_ref {
+	avl_timer_t timer;
+	int armed;
+	long deadline;
+	unsigned long seq;
+} timer_ref_t;
+
+static timer_ref_t timers[TIMERS];
+static unsigned long timer_seq;
+
+/* The armed timer that should expire first, if it is due by now. */
+static timer_ref_t *timer_first(long now) {
+	timer_ref_t *first = NULL, *t;
+
+	for(t = timers; t < timers + TIMERS; t++)
+		if(t->armed && t->deadline <= now
+		&& (!first || t->deadline < first->deadline
+			|| (t->deadline == first->deadline && t->seq < first->seq)))
+			first = t;
+
+	return first;
+}
+
+static void timer_expired(avl_timer_t *timer, void *userdata) {
+	timer_ref_t *t;
+
+	t = timer_first(*(const long *)userdata);
+	if(!t || &t->timer != timer)
+		fail("avl_timer_run() expired timers out of order");
+	if(avl_timer_armed(timer))
+		fail("avl_timer_run() left an expired timer armed");
+	t->armed = 0;
+}
+
+static void timer_run(avl_tree_t *tree, long now) {
+	struct timespec ts;
+	timer_ref_t *t;
+	unsigned long n = 0;
+
+	for(t = timers; t < timers + TIMERS; t++)
+		if(t->armed && t->deadline <= now)
+			n++;
+
+	ts.tv_sec = now / 2;
+	ts.tv_nsec = now % 2 * 500000000L;
+	if(avl_timer_run(tree, &ts, timer_expired, &now) != n)
+		fail("avl_timer_run() expired the wrong number of timers");
+}
+
+/* Arms, cancels and expires a handful of timers with few distinct
+ * deadlines, so that rearming often lands on an equal one. */
+static void check_timers(void) {
+	avl_tree_t tree;
+	struct timespec ts;
+	timer_ref_t *t;
+	long now = 0;
+	int i, k;
+
+	avl_timer_tree_init(&tree);
+	for(t = timers; t < timers + TIMERS; t++) {
+		avl_timer_init(&t->timer);
+		t->armed = 0;
+	}
+
+	for(i = 0; i < 16; i++) {
+		k = next_byte();
+		t = &timers[k % TIMERS];
+		switch(k / TIMERS % 4) {
+		case 0:
+		case 1:
+			t->deadline = now + k / 32 % 4;
+			ts.tv_sec = t->deadline / 2;
+			ts.tv_nsec = t->deadline % 2 * 500000000L;
+			(void)avl_timer_arm(&tree, &t->timer, &ts);
+			t->armed = 1;
+			t->seq = timer_seq++;
+			break;
+		case 2:
+			if(avl_timer_cancel(&tree, &t->timer) != t->armed)
+				fail("avl_timer_cancel() disagrees with the reference");
+			t->armed = 0;
+			break;
+		case 3:
+			now += k / 32 % 3;
+			timer_run(&tree, now);
+		}
+	}
+
+	timer_run(&tree, now + 4);
+	if(tree.head)
+		fail("avl_timer_run() left timers behind");
+}
+#endif
+
+#ifdef AVL_MULTISET
+/* Counts the changes that hooks are told about. */
+static unsigned long changes;
+
+static void note_change(avl_hooks_t *hooks, avl_tree_t *tree, avl_node_t *node) {
+	changes++;
+}
+
+static avl_hooks_t note_hooks = { note_change, note_change, NULL };
+#endif
+
+#if AVL_HAVE_POSIX && !defined(AVL_NO_LIST)
+/* Compacts a copy of the tree in small steps, deleting the last node
+ * visited and inserting its item again in between, which leaves the
+ * contents as they were but makes the compaction lose its place. */
+static void check_compact(const avl_tree_t *tree, int how) {
+	avl_tree_t copy;
+	avl_compact_t compact;
+	avl_allocator_t *arena;
+	avl_node_t *node;
+	const void *item;
+	unsigned long steps;
+#	ifdef AVL_MULTISET
+	unsigned long n;
+#	endif
+
+	avl_tree_init(&copy, NULL, NULL);
+	if(avl_tree_clone(tree, &copy))
+		fail("avl_tree_clone() failed");
+	arena = avl_arena_allocator_new(AVL_ARENA_NORMAL);
+	if(!arena || !avl_compact_init(&compact, &copy, arena))
+		fail("avl_compact_init() failed");
+
+	for(steps = 0; avl_compact_step(&compact, how % 4 + 2) > 0; steps++) {
+		if(steps > refn)
+			fail("avl_compact_step() makes no progress");
+		node = compact.last;
+		if(!node || next_byte() & 1)
+			continue;
+		item = node->item;
+#		ifdef AVL_MULTISET
+		n = node->multiplicity;
+#		endif
+		(void)avl_delete(&copy, node);
+#		ifdef AVL_MULTISET
+		node = avl_item_add(&copy, item, n);
+#		else
+		node = avl_item_insert_right(&copy, item);
+#		endif
+		if(!node)
+			fail("inserting during compaction failed");
+	}
+	if(!compact.done)
+		fail("avl_compact_step() failed");
+
+	check(&copy);
+	(void)avl_tree_purge(&copy);
+	avl_arena_allocator_free(arena);
+}
+#endif
+
+static int full(unsigned long n) {
+	return refn + n > REF_MAX;
+}
+
+static void run(avl_tree_t *tree) {
+	avl_tree_t copy;
+	avl_node_t *node, *list;
+	void *items[16];
+	unsigned long i, n, before;
+	int v, k, op;
+
+	op = next_byte() % 16;
+	v = next_byte();
+	before = tree_count(tree);
+
+	switch(op) {
+	case 0:
+		if(full(1))
+			break;
+		node = avl_item_insert(tree, item_of(v));
+		if(!node != (ref_lower(v) != ref_upper(v)))
+			fail("avl_item_insert() disagrees on presence");
+		if(node)
+			ref_insert(v, 1);
+		break;
+	case 1:
+	case 2:
+		if(full(1))
+			break;
+		i = op == 1 ? ref_lower(v) : ref_upper(v);
+		node = op == 1
+			? avl_item_insert_left(tree, item_of(v))
+			: avl_item_insert_right(tree, item_of(v));
+		if(!node)
+			fail("insert failed");
+		ref_insert(v, 1);
+#ifdef AVL_COUNT
+		if(avl_index(node) != i)
+			fail("inserted node is not at the edge of its equals");
+#else
+		(void)i;
+#endif
+		break;
+	case 3:
+		(void)avl_item_delete(tree, item_of(v));
+		if((before == tree_count(tree)) != (ref_lower(v) == ref_upper(v)))
+			fail("avl_item_delete() disagrees on presence");
+		ref_remove(v, before - tree_count(tree));
+		break;
+	case 4:
+		if(!refn)
+			break;
+		node = node_at(tree, v % refn);
+		if(!node || value_of(node->item) != ref[v % refn])
+			fail("wrong node at rank");
+		v = value_of(node->item);
+		(void)avl_delete(tree, node);
+		ref_remove(v, before - tree_count(tree));
+		break;
+	case 5:
+	case 6:
+		node = op == 5 ? tree->head : tree->tail;
+		if(!node != !refn)
+			fail("head or tail disagrees with the size");
+		if(!node)
+			break;
+		if(value_of(op == 5 ? avl_pop_min(tree) : avl_pop_max(tree)) != ref[op == 5 ? 0 : refn - 1])
+			fail("popped the wrong item");
+		ref_remove(op == 5 ? ref[0] : ref[refn - 1], before - tree_count(tree));
+		break;
+	case 7:
+		n = avl_pop_min_n(tree, items, v % 16);
+		before -= tree_count(tree);
+		/* Each item stands for all copies in its node. */
+		for(i = 0, k = 0; i < n; i++) {
+#ifdef AVL_MULTISET
+			if(i && items[i] == items[i - 1])
+				continue;
+#endif
+			if((unsigned long)k >= before || value_of(items[i]) != ref[k])
+				fail("avl_pop_min_n() popped the wrong item");
+#ifdef AVL_MULTISET
+			while((unsigned long)k < before && ref[k] == value_of(items[i]))
+				k++;
+#else
+			k++;
+#endif
+		}
+		if((unsigned long)k != before)
+			fail("avl_pop_min_n() popped the wrong number of items");
+		memmove(ref, ref + before, refn - before);
+		refn -= before;
+		break;
+	case 8:
+		if(!refn)
+			break;
+		list = avl_unlink_upto(tree, node_at(tree, v % refn));
+		for(; list; list = node) {
+			node = list->right;
+			free(list);
+		}
+		memmove(ref, ref + before - tree_count(tree), tree_count(tree));
+		refn = tree_count(tree);
+		break;
+	case 9:
+		if(!refn)
+			break;
+		node = node_at(tree, next_byte() % refn);
+		n = node_mult(node);
+		ref_remove(value_of(node->item), n);
+		ref_insert(v, n);
+		if(avl_reinsert(tree, node, item_of(v)) != node)
+			fail("avl_reinsert() failed");
+		if(avl_next(node) && value_of(avl_next(node)->item) == v)
+			fail("avl_reinsert() put the node before an equal one");
+		break;
+	case 10:
+		k = v % 16;
+		for(i = 0; i < (unsigned long)k; i++)
+			items[i] = (void *)item_of(next_byte());
+		for(i = 1; i < (unsigned long)k; i++)
+			for(n = i; n && value_of(items[n - 1]) > value_of(items[n]); n--) {
+				list = items[n];
+				items[n] = items[n - 1];
+				items[n - 1] = list;
+			}
+		if(full(k))
+			break;
+		before = 0;
+		for(i = 0; i < (unsigned long)k; i++) {
+			if(i && items[i] == items[i - 1])
+				continue;
+			if(ref_lower(value_of(items[i])) == ref_upper(value_of(items[i]))) {
+				ref_insert(value_of(items[i]), 1);
+				before++;
+			}
+		}
+		if(avl_tree_insert_sorted_batch(tree, items, k) != (long)before)
+			fail("avl_tree_insert_sorted_batch() inserted the wrong number");
+		break;
+	case 11:
+		if(avl_tree_hash_index(tree, tree->hash ? (avl_hash_t)NULL : value_hash))
+			fail("avl_tree_hash_index() failed");
+		break;
+	case 12:
+		node = avl_search(tree, item_of(v));
+		if(!node != (ref_lower(v) == ref_upper(v)))
+			fail("avl_search() disagrees on presence");
+		if(node && value_of(node->item) != v)
+			fail("avl_search() found the wrong item");
+		break;
+#ifdef AVL_MULTISET
+	case 13:
+		n = next_byte() % 4;
+		if(full(n))
+			break;
+		errno = 0;
+		changes = 0;
+		tree->hooks = &note_hooks;
+		node = avl_item_add(tree, item_of(v), n);
+		tree->hooks = NULL;
+		if(!node != (!n && ref_lower(v) == ref_upper(v)))
+			fail("avl_item_add() failed");
+		if(!node && errno != EINVAL)
+			fail("avl_item_add() did not set errno");
+		if(!n && changes)
+			fail("avl_item_add() called a hook without adding anything");
+		ref_insert(v, n);
+		break;
+	case 14:
+		k = next_byte() % 4;
+		changes = 0;
+		tree->hooks = &note_hooks;
+		n = avl_item_remove(tree, item_of(v), k);
+		tree->hooks = NULL;
+		if(n != before - tree_count(tree))
+			fail("avl_item_remove() miscounted");
+		if(!k && changes)
+			fail("avl_item_remove() called a hook without removing anything");
+		ref_remove(v, n);
+		break;
+#else
+	case 13:
+		if(full(1))
+			break;
+		if(!avl_item_insert_somewhere(tree, item_of(v)))
+			fail("insert failed");
+		ref_insert(v, 1);
+		break;
+#ifndef AVL_NO_LIST
+	case 14:
+		/* Move a node in memory. */
+		if(!refn)
+			break;
+		node = node_at(tree, v % refn);
+		list = malloc(sizeof *list);
+		if(!list)
+			fail("out of memory");
+		memcpy(list, node, sizeof *list);
+		if(avl_fixup(tree, list) != node)
+			fail("avl_fixup() returned the wrong node");
+		free(node);
+		break;
+#endif
+#endif
+	case 15:
+		if(v < 16) {
+			for(i = k = 0; i < refn; i++)
+				if(ref[i] % (v + 2))
+					ref[k++] = ref[i];
+			/* Each deleted node may stand for several copies. */
+			if(avl_tree_retain(tree, value_keep, &v) < 0)
+				fail("avl_tree_retain() failed");
+			refn = k;
+		} else if(v < 32) {
+			avl_tree_init(&copy, NULL, NULL);
+			if(tree->hash && avl_tree_hash_index(&copy, value_hash))
+				fail("avl_tree_hash_index() failed");
+#if AVL_HAVE_POSIX
+			if(avl_tree_clone_parallel(tree, &copy, v % 4 + 1))
+				fail("avl_tree_clone_parallel() failed");
+#else
+			if(avl_tree_clone(tree, &copy))
+				fail("avl_tree_clone() failed");
+#endif
+			check(&copy);
+			(void)avl_tree_purge(tree);
+			(void)avl_tree_hash_index(tree, NULL);
+			*tree = copy;
+		} else if(v < 48) {
+			if(avl_tree_resort(tree, value_cmp_reverse, NULL))
+				fail("avl_tree_resort() failed");
+			for(node = tree->head, i = refn; node; node = avl_next(node))
+				for(n = node_mult(node); n; n--)
+					if(!i-- || value_of(node->item) != ref[i])
+						fail("avl_tree_resort() did not reverse the order");
+			if(avl_tree_resort(tree, value_cmp, NULL))
+				fail("avl_tree_resort() failed");
+#ifdef AVL_COUNT
+		} else if(v < 64 && !tree->hash) {
+			/* Split and stitch back together, which must not change
+			 * anything. */
+			avl_tree_init(&copy, value_cmp, NULL);
+			if(avl_tree_split(tree, before * (v - 48) / 16, &copy))
+				fail("avl_tree_split() failed");
+			if(avl_tree_verify(tree) || avl_tree_verify(&copy))
+				fail("avl_tree_split() left a broken tree");
+			if(avl_tree_concat(tree, &copy) || copy.top)
+				fail("avl_tree_concat() failed");
+#endif
+#ifdef AVL_MERKLE
+		} else if(v < 80 && unique(tree)) {
+			/* Drop every few nodes from a copy; the differences
+			 * must be exactly those. */
+			diffs_t d;
+			avl_tree_init(&copy, NULL, NULL);
+			if(avl_tree_clone(tree, &copy))
+				fail("avl_tree_clone() failed");
+			if(avl_tree_digest(&copy) != avl_tree_digest(tree))
+				fail("avl_tree_clone() changed the digest");
+			for(node = copy.head, i = n = 0; node; i++) {
+				list = avl_next(node);
+				if(i % (v % 5 + 2) == 0) {
+					(void)avl_delete(&copy, node);
+					n++;
+				}
+				node = list;
+			}
+			for(d.side = 0; d.side < 2; d.side++) {
+				d.n = 0;
+				d.last = -1;
+				if(d.side ? avl_tree_diff(&copy, tree, count_diff, &d) : avl_tree_diff(tree, &copy, count_diff, &d))
+					fail("avl_tree_diff() failed");
+				if(d.n != n)
+					fail("avl_tree_diff() missed differences");
+			}
+			(void)avl_tree_purge(&copy);
+#endif
+		} else if(v < 96 && unique(tree)) {
+			/* Change the tree with a log attached, then bring a copy
+			 * up to date from the log. */
+			avl_log_t log;
+			avl_tree_init(&copy, NULL, NULL);
+			if(avl_tree_clone(tree, &copy))
+				fail("avl_tree_clone() failed");
+			if(!avl_log_init(&log, tree, NULL, NULL))
+				fail("avl_log_init() failed");
+			for(i = 0; i < 8; i++) {
+				k = next_byte();
+				node = avl_search(tree, item_of(k));
+				if(node) {
+					ref_remove(k, node_mult(node));
+					(void)avl_delete(tree, node);
+				} else if(!full(1)) {
+					if(!avl_item_insert(tree, item_of(k)))
+						fail("avl_item_insert() failed");
+					ref_insert(k, 1);
+				}
+			}
+			if(avl_log_count(&log) > 8)
+				fail("avl_log_count() is too high");
+			if(avl_log_dump(&log, apply_delta, &copy))
+				fail("avl_log_dump() failed");
+			avl_log_free(&log);
+			check(&copy);
+			(void)avl_tree_purge(&copy);
+		} else if(v < 112) {
+			/* Bounds and seeks are often equal to items in the
+			 * tree, and there may be several of those. */
+			k = next_byte();
+			n = v & 1 ? next_byte() : k + next_byte() % 8;
+			check_cursor(tree, k, n < 256 ? n : 255, next_byte(), next_byte());
+#if AVL_HAVE_POSIX
+		} else if(v < 128) {
+			check_timers();
+#endif
+#if AVL_HAVE_POSIX && !defined(AVL_NO_LIST)
+		} else if(v < 144) {
+			check_compact(tree, next_byte());
+#endif
+		} else if(v == 255) {
+			(void)avl_tree_purge(tree);
+			refn = 0;
+		}
+		break;
+	}
+
+	check(tree);
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size) {
+	avl_tree_t tree;
+
+	avl_tree_init(&tree, value_cmp, NULL);
+#ifdef AVL_MERKLE
+	avl_tree_merkle(&tree, value_hash);
+#endif
+	input = data;
+	input_end = data + size;
+	refn = 0;
+
+	for(step = 0; input < input_end; step++)
+		run(&tree);
+
+	(void)avl_tree_purge(&tree);
+	(void)avl_tree_hash_index(&tree, NULL);
+	return 0;
+}
+
+#ifndef AVL_LIBFUZZER
+static int run_file(const char *name) {
+	unsigned char *buf;
+	size_t size, len;
+	FILE *f;
+
+	f = fopen(name, "rb");
+	if(!f) {
+		perror(name);
+		return -1;
+	}
+
+	buf = NULL;
+	size = len = 0;
+	do {
+		size = size ? size * 2 : 4096;
+		buf = realloc(buf, size);
+		if(!buf) {
+			perror(name);
+			return -1;
+		}
+		len += fread(buf + len, 1, size - len, f);
+	} while(len == size);
+	fclose(f);
+
+	LLVMFuzzerTestOneInput(buf, len);
+	free(buf);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	unsigned char buf[4096];
+	unsigned long seed = 1, runs = 10000, r, x;
+	size_t len, i;
+	int c, err = 0;
+
+	while((c = getopt(argc, argv, "s:n:")) != EOF) {
+		switch(c) {
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			runs = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s seed] [-n runs] [file...]\n", *argv);
+			return EX_USAGE;
+		}
+	}
+
+	if(optind < argc) {
+		for(; optind < argc; optind++)
+			if(run_file(argv[optind]))
+				err = EX_NOINPUT;
+		return err;
+	}
+
+	x = seed;
+	for(r = 0; r < runs; r++) {
+		x = (x * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+		len = (x >> 8) % sizeof buf;
+		for(i = 0; i < len; i++) {
+			x = (x * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+			buf[i] = x >> 16;
+		}
+		LLVMFuzzerTestOneInput(buf, len);
+	}
+	printf("%lu runs from seed %lu passed\n", runs, seed);
+
+	return 0;
+}
+#endif
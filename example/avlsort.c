@@ -20,114 +20,616 @@
 	and a copy of the GNU Lesser General Public License along with
 	libavl.  If not, see <http://www.gnu.org/licenses/>.
 
+	Sorts lines bytewise, like LC_ALL=C sort(1).
+
+	avlsort [-u] [-v] [-j threads] [-S size] [-T tmpdir] [file]
+
+	A regular file is mmap()ed and cut into one range per thread; other
+	input is read in segments of half the memory budget that are cut up
+	the same way. Every thread inserts the lines of its range into trees
+	of its own, with nodes that point into the input and that cache the
+	first bytes of their line. A tree is closed when it holds TREE_LINES
+	lines, which keeps it small enough to stay in the cache while it is
+	built. When the lines and nodes of a thread exceed its share of the
+	budget (-S), its trees are merged into a sorted run in an unlinked
+	temporary file in -T, $TMPDIR or /tmp. As soon as there are
+	MERGE_MAX runs of the same level, the thread that wrote the last one
+	merges them into a run of the next level, so that only a few runs
+	wait at any time, and only as file descriptors: a run gets a stdio
+	buffer only while it is written or merged. The runs and the trees
+	that are left are then merged into the output, using a small tree of
+	the sources (ordered on their current line) as the merge heap. With
+	-u, only the first of a series of equal lines is kept.
+
 *****************************************************************************/
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
 #include "avl.h"
 
-int main(int argc, char **argv) {
-	avl_tree_t *t;
-	avl_node_t *c;
-	char *s, *n;
-	char *ob, *bb, *eb;
-	int r, bs;
-	int l, u;
-	struct stat st;
-	int mmapped = 0;
-
-	t = avl_tree_malloc((avl_cmp_t)strcmp, NULL);
-/*	t = avl_tree_malloc((avl_cmp_t)avl_pointer_cmp, NULL); */
-
-	u = 0;
-	if(!fstat(STDIN_FILENO, &st) && S_ISREG(st.st_mode)) {
-		bs = st.st_size;
-		bb = eb = mmap(NULL, bs+1, PROT_READ|PROT_WRITE, MAP_PRIVATE, STDIN_FILENO, 0);
-		if(bb) {
-			mmapped = 1;
-			eb = bb+bs;
-		} else {
-			bb = eb = malloc(bs+1);
-			if(!bb) {
-				perror("malloc()");
-				exit(2);
-			}
-			while(bs > 0) {
-				r = read(STDIN_FILENO, eb, bs);
-				if(r <= 0) {
-					perror("moo");
-					exit(2);
-				}
-				eb += r;
-				bs -= r;
+/* Nodes are allocated this many at a time. */
+#define POOL_BLOCK 65536
+
+/* Lines per tree. Larger trees no longer fit in the cache, and every
+ * level then costs a cache miss or two. */
+#define TREE_LINES 8192
+
+/* Most runs that are merged at once; more are merged in several passes. */
+#define MERGE_MAX 64
+
+/* Ranges smaller than this are not worth a thread. */
+#define RANGE_MIN 65536
+
+#define IO_BUFSIZE (1 << 20)
+
+/* Smallest stdio buffer for a run. */
+#define RUN_BUFSIZE_MIN 4096
+
+typedef struct line {
+	avl_node_t node;
+	unsigned long key;
+	const char *text;
+	size_t len;
+} line_t;
+
+/* Runs that wait to be merged; a run of level l + 1 holds the lines of
+ * MERGE_MAX runs of level l. */
+typedef struct level {
+	int fds[MERGE_MAX];
+	size_t n;
+} level_t;
+
+typedef struct worker {
+	pthread_t thread;
+	const char *begin, *end;
+	int spill_all;
+	avl_tree_t tree;
+	avl_tree_t *trees;
+	size_t ntrees, tree_lines;
+	size_t used;
+	line_t **blocks;
+	size_t nblocks, block, index;
+	unsigned long lines;
+} worker_t;
+
+/* A source for the merge: its current line is the key in the heap. */
+typedef struct source {
+	line_t line;
+	avl_node_t *next;
+	FILE *file;
+	char *iobuf;
+	char *buf;
+	size_t cap;
+} source_t;
+
+static int unique;
+static size_t share, run_bufsize;
+static const char *tmpdir;
+
+static pthread_mutex_t runs_lock = PTHREAD_MUTEX_INITIALIZER;
+static level_t *levels;
+static size_t nlevels;
+static unsigned long spilled;
+
+static void die(const char *what) {
+	perror(what);
+	exit(2);
+}
+
+static void *xmalloc(size_t size) {
+	void *p;
+
+	p = malloc(size);
+	if(!p)
+		die("malloc()");
+	return p;
+}
+
+static void *xrealloc(void *p, size_t size) {
+	p = realloc(p, size);
+	if(!p)
+		die("realloc()");
+	return p;
+}
+
+/* The first bytes of the line, big endian, so that most comparisons
+ * don't have to look at the text. */
+static void line_set(line_t *line, const char *text, size_t len) {
+	unsigned long key = 0;
+	size_t i;
+
+	for(i = 0; i < sizeof key; i++)
+		key = key << 8 | (i < len ? (unsigned char)text[i] : 0);
+
+	line->key = key;
+	line->text = text;
+	line->len = len;
+}
+
+static int line_cmp(const void *a, const void *b, void *userdata) {
+	const line_t *x = a, *y = b;
+	int c;
+
+	if(x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	c = memcmp(x->text, y->text, x->len < y->len ? x->len : y->len);
+	if(c)
+		return c;
+	return AVL_CMP(x->len, y->len);
+}
+
+static void emit(FILE *f, const char *text, size_t len) {
+	if(fwrite(text, 1, len, f) != len || putc('\n', f) == EOF)
+		die("write");
+}
+
+static line_t *pool_alloc(worker_t *w) {
+	if(w->index == POOL_BLOCK) {
+		w->block++;
+		w->index = 0;
+	}
+	if(w->block == w->nblocks) {
+		w->blocks = xrealloc(w->blocks, (w->nblocks + 1) * sizeof *w->blocks);
+		w->blocks[w->nblocks++] = xmalloc(POOL_BLOCK * sizeof(line_t));
+	}
+	return w->blocks[w->block] + w->index++;
+}
+
+static void pool_reset(worker_t *w) {
+	w->block = w->index = 0;
+}
+
+/* Creates an unlinked temporary file to write a run to. */
+static FILE *run_create(char **buf) {
+	char *path;
+	FILE *f;
+	int fd;
+
+	path = xmalloc(strlen(tmpdir) + sizeof "/avlsortXXXXXX");
+	strcpy(path, tmpdir);
+	strcat(path, "/avlsortXXXXXX");
+	fd = mkstemp(path);
+	if(fd == -1)
+		die(path);
+	unlink(path);
+	free(path);
+
+	f = fdopen(fd, "w");
+	if(!f)
+		die("fdopen()");
+	*buf = xmalloc(run_bufsize);
+	setvbuf(f, *buf, _IOFBF, run_bufsize);
+	return f;
+}
+
+/* Finishes writing a run and returns its file descriptor, rewound. The
+ * stream and its buffer are given up until the run is merged. */
+static int run_finish(FILE *f, char *buf) {
+	int fd;
+
+	if(fflush(f))
+		die("temporary file");
+	fd = dup(fileno(f));
+	if(fd == -1)
+		die("dup()");
+	if(fclose(f))
+		die("temporary file");
+	free(buf);
+	if(lseek(fd, 0, SEEK_SET) == -1)
+		die("temporary file");
+	return fd;
+}
+
+static void source_open(source_t *s, int fd) {
+	s->file = fdopen(fd, "r");
+	if(!s->file)
+		die("fdopen()");
+	s->iobuf = xmalloc(run_bufsize);
+	setvbuf(s->file, s->iobuf, _IOFBF, run_bufsize);
+}
+
+static void merge(source_t *sources, size_t n, FILE *f);
+
+/* Merges n runs into a new one and returns it. */
+static int merge_runs(const int *fds, size_t n) {
+	source_t *sources;
+	char *buf;
+	FILE *f;
+	size_t i;
+
+	sources = xmalloc(n * sizeof *sources);
+	memset(sources, 0, n * sizeof *sources);
+	for(i = 0; i < n; i++)
+		source_open(sources + i, fds[i]);
+
+	f = run_create(&buf);
+	merge(sources, n, f);
+	free(sources);
+
+	return run_finish(f, buf);
+}
+
+/* Adds a run of the given level. Once there are MERGE_MAX of them, they
+ * are merged into a run of the next level, and so on. */
+static void run_add(int fd, size_t level) {
+	int fds[MERGE_MAX];
+	level_t *l;
+
+	for(;;) {
+		pthread_mutex_lock(&runs_lock);
+		if(level == nlevels) {
+			levels = xrealloc(levels, (nlevels + 1) * sizeof *levels);
+			levels[nlevels++].n = 0;
+		}
+		l = levels + level;
+		l->fds[l->n++] = fd;
+		if(l->n < MERGE_MAX) {
+			pthread_mutex_unlock(&runs_lock);
+			return;
+		}
+		memcpy(fds, l->fds, sizeof fds);
+		l->n = 0;
+		pthread_mutex_unlock(&runs_lock);
+
+		fd = merge_runs(fds, MERGE_MAX);
+		level++;
+	}
+}
+
+/* Closes the current tree of the worker, if it has any lines. */
+static void close_tree(worker_t *w) {
+	if(!w->tree.head)
+		return;
+	w->trees = xrealloc(w->trees, (w->ntrees + 1) * sizeof *w->trees);
+	w->trees[w->ntrees++] = w->tree;
+	avl_tree_init(&w->tree, line_cmp, NULL);
+	w->tree_lines = 0;
+}
+
+/* Merges the trees of the worker into a new run and empties them. */
+static void spill(worker_t *w) {
+	source_t *sources;
+	char *buf;
+	FILE *f;
+	size_t i;
+
+	close_tree(w);
+	if(!w->ntrees)
+		return;
+	sources = xmalloc(w->ntrees * sizeof *sources);
+	memset(sources, 0, w->ntrees * sizeof *sources);
+	for(i = 0; i < w->ntrees; i++)
+		sources[i].next = w->trees[i].head;
+
+	f = run_create(&buf);
+	merge(sources, w->ntrees, f);
+	free(sources);
+
+	pthread_mutex_lock(&runs_lock);
+	spilled++;
+	pthread_mutex_unlock(&runs_lock);
+	run_add(run_finish(f, buf), 0);
+
+	w->ntrees = 0;
+	pool_reset(w);
+	w->used = 0;
+}
+
+static void *worker(void *arg) {
+	worker_t *w = arg;
+	const char *p, *e, *end;
+	line_t *line;
+
+	end = w->end;
+	for(p = w->begin; p < end; p = e ? e + 1 : end) {
+		e = memchr(p, '\n', end - p);
+		line = pool_alloc(w);
+		line_set(line, p, (e ? e : end) - p);
+		avl_node_init(&line->node, line);
+		if(unique) {
+			if(!avl_insert(&w->tree, &line->node)) {
+				w->index--;
+				continue;
 			}
+		} else {
+			avl_insert_right(&w->tree, &line->node);
+		}
+		w->lines++;
+		w->used += line->len + sizeof *line;
+		if(w->used >= share && e && e + 1 < end)
+			spill(w);
+		else if(++w->tree_lines == TREE_LINES)
+			close_tree(w);
+	}
+
+	if(w->spill_all)
+		spill(w);
+	else
+		close_tree(w);
+
+	return NULL;
+}
+
+/* Sorts the lines in [begin, end) with the workers. If spill_all is set
+ * every worker writes its last tree out as well, so that the region
+ * can be reused. */
+static void sort_region(worker_t *workers, int nworkers, const char *begin, const char *end, int spill_all) {
+	const char *p, *q;
+	size_t size;
+	int i, n;
+
+	size = end - begin;
+	n = size / RANGE_MIN + 1;
+	if(n > nworkers)
+		n = nworkers;
+
+	for(p = begin, i = 0; i < n; i++) {
+		q = i == n - 1 ? end : begin + size / n * (i + 1);
+		if(q < p)
+			q = p;
+		while(q < end && q[-1] != '\n')
+			q++;
+		workers[i].begin = p;
+		workers[i].end = q;
+		workers[i].spill_all = spill_all;
+		p = q;
+	}
+
+	if(n == 1) {
+		worker(workers);
+		return;
+	}
+
+	for(i = 0; i < n; i++)
+		if((errno = pthread_create(&workers[i].thread, NULL, worker, workers + i)))
+			die("pthread_create()");
+	for(i = 0; i < n; i++)
+		pthread_join(workers[i].thread, NULL);
+}
+
+/* Sets the current line of the source to the next one it has.
+ * Returns 0 if it has none left. */
+static int source_advance(source_t *s) {
+	const line_t *line;
+	ssize_t r;
+
+	if(s->file) {
+		r = getline(&s->buf, &s->cap, s->file);
+		if(r <= 0) {
+			if(ferror(s->file))
+				die("temporary file");
+			return 0;
 		}
+		line_set(&s->line, s->buf, r - 1);
 	} else {
-		bs = 65536; r = 0;
-		bb = eb = ob = malloc(bs);
-		if(!bb) {
-			perror("malloc()");
-			exit(2);
+		if(!s->next)
+			return 0;
+		line = s->next->item;
+		s->line.key = line->key;
+		s->line.text = line->text;
+		s->line.len = line->len;
+		s->next = avl_next(s->next);
+	}
+	return 1;
+}
+
+/* Merges the sources into f. */
+static void merge(source_t *sources, size_t n, FILE *f) {
+	avl_tree_t heap;
+	avl_node_t *node;
+	source_t *s;
+	char *last;
+	size_t lastlen = 0, lastcap = 1;
+	int first = 1;
+	size_t i;
+
+	/* Never NULL, not even for an empty first line: memcmp() and
+	 * memcpy() want a valid pointer whatever the length. */
+	last = xmalloc(lastcap);
+
+	avl_tree_init(&heap, line_cmp, NULL);
+	for(i = 0; i < n; i++)
+		if(source_advance(sources + i))
+			avl_insert_right(&heap, avl_node_init(&sources[i].line.node, sources + i));
+
+	while((node = heap.head)) {
+		s = node->item;
+		if(!unique) {
+			emit(f, s->line.text, s->line.len);
+		} else if(first || s->line.len != lastlen || memcmp(s->line.text, last, lastlen)) {
+			emit(f, s->line.text, s->line.len);
+			if(s->line.len > lastcap)
+				last = xrealloc(last, lastcap = s->line.len);
+			memcpy(last, s->line.text, lastlen = s->line.len);
+			first = 0;
+		}
+		if(source_advance(s))
+			avl_reinsert(&heap, node, s);
+		else
+			avl_unlink(&heap, node);
+	}
+
+	/* The runs are used up. */
+	for(i = 0; i < n; i++) {
+		if(sources[i].file) {
+			fclose(sources[i].file);
+			free(sources[i].iobuf);
 		}
+		free(sources[i].buf);
+	}
+	free(last);
+}
+
+/* Sets the part of the budget of each thread. A merge of MERGE_MAX runs
+ * into another needs MERGE_MAX + 1 buffers, which get half of that. */
+static void set_share(size_t size) {
+	share = size;
+	run_bufsize = share / 2 / (MERGE_MAX + 1);
+	if(run_bufsize < RUN_BUFSIZE_MIN)
+		run_bufsize = RUN_BUFSIZE_MIN;
+	if(run_bufsize > IO_BUFSIZE)
+		run_bufsize = IO_BUFSIZE;
+}
+
+static size_t parse_size(const char *s) {
+	unsigned long n;
+	char *e;
+
+	n = strtoul(s, &e, 10);
+	switch(*e) {
+	case 'G': case 'g':
+		n <<= 10;
+		/* FALLTHROUGH */
+	case 'M': case 'm':
+		n <<= 10;
+		/* FALLTHROUGH */
+	case 'K': case 'k':
+		n <<= 10;
+		e++;
+	}
+	if(*e || !n) {
+		fprintf(stderr, "avlsort: invalid size '%s'\n", s);
+		exit(2);
+	}
+	return n;
+}
+
+int main(int argc, char **argv) {
+	worker_t *workers;
+	source_t *sources;
+	int *runs = NULL, run;
+	size_t nruns = 0, nsources, ntrees, budget = 256UL << 20;
+	size_t i, j, len, seg;
+	unsigned long lines = 0;
+	char *buf, *p;
+	struct stat st;
+	int fd, c, nworkers = 0, verbose = 0;
+	long ncpu;
+	ssize_t r = 0;
+
+	while((c = getopt(argc, argv, "uvj:S:T:")) != -1) {
+		switch(c) {
+		case 'u':
+			unique = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'j':
+			nworkers = atoi(optarg);
+			break;
+		case 'S':
+			budget = parse_size(optarg);
+			break;
+		case 'T':
+			tmpdir = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-u] [-v] [-j threads] [-S size] [-T tmpdir] [file]\n", *argv);
+			return 2;
+		}
+	}
+
+	if(nworkers < 1) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nworkers = ncpu > 0 ? ncpu : 1;
+	}
+	if(!tmpdir)
+		tmpdir = getenv("TMPDIR");
+	if(!tmpdir || !*tmpdir)
+		tmpdir = "/tmp";
+
+	fd = STDIN_FILENO;
+	if(optind < argc && strcmp(argv[optind], "-")) {
+		fd = open(argv[optind], O_RDONLY);
+		if(fd == -1)
+			die(argv[optind]);
+	}
+
+	workers = xmalloc(nworkers * sizeof *workers);
+	memset(workers, 0, nworkers * sizeof *workers);
+	for(c = 0; c < nworkers; c++)
+		avl_tree_init(&workers[c].tree, line_cmp, NULL);
+
+	if(!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0
+	&& (off_t)(size_t)st.st_size == st.st_size
+	&& (buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+		set_share(budget / nworkers);
+		sort_region(workers, nworkers, buf, buf + st.st_size, 0);
+	} else {
+		/* Half of the budget for the text, the rest for the nodes. */
+		seg = budget / 2 > RANGE_MIN ? budget / 2 : RANGE_MIN;
+		set_share(seg / nworkers);
+		buf = xmalloc(seg);
+		len = 0;
 		for(;;) {
-			eb += r;
-			r = read(STDIN_FILENO, eb, 65536);
-			if(r < 0) {
-				perror("moo");
-				exit(2);
-			}
-			if(r == 0)
+			while(len < seg && (r = read(fd, buf + len, seg - len)) > 0)
+				len += r;
+			if(len < seg) {
+				if(r < 0)
+					die("read");
+				sort_region(workers, nworkers, buf, buf + len, 0);
 				break;
-			bb = realloc(ob = bb, bs += r);
-			if(!bb) {
-				fprintf(stderr, "realloc() to %d bytes failed.\n", bs);
-				exit(2);
 			}
-			if(bb != ob) {
-				eb += bb - ob;
-				u++;
+			for(p = buf + len; p > buf && p[-1] != '\n'; p--);
+			if(p == buf) {
+				/* A line longer than the segment. */
+				buf = xrealloc(buf, seg *= 2);
+				continue;
 			}
+			sort_region(workers, nworkers, buf, p, 1);
+			len = buf + len - p;
+			memmove(buf, p, len);
 		}
 	}
 
-	if(*(eb-1) != '\n')
-		*eb++ = '\n';
-	bs = eb - bb;
-	bb = s = mmapped?(ob=bb):realloc(ob = bb, bs);
-	if(bb != ob)
-		u++;
-	eb = bb + bs;
-	if(mmapped)
-		fprintf(stderr, "Finished reading input (mmap()ed)\n");
-	else
-		fprintf(stderr, "Finished reading input (%d relocations)\n", u);
-
-	l = 0;
-	for(n = s = bb; s<eb; s = n) {
-		n = strchr(n, '\n');
-		*n++ = '\0';
-		avl_item_insert_somewhere(t, s);
-		l++;
+	/* Gather the runs that are left; merge them down to a number that
+	 * can be merged at once, together with the trees that are left. */
+	ntrees = 0;
+	for(c = 0; c < nworkers; c++) {
+		lines += workers[c].lines;
+		ntrees += workers[c].ntrees;
+	}
+	for(i = nlevels; i--;) {
+		runs = xrealloc(runs, (nruns + levels[i].n + 1) * sizeof *runs);
+		for(j = 0; j < levels[i].n; j++)
+			runs[nruns++] = levels[i].fds[j];
 	}
-	fprintf(stderr, "Inserted %d lines\n", l);
+	if(verbose)
+		fprintf(stderr, "avlsort: %lu lines, %lu runs, %lu trees, %d threads\n",
+			lines, spilled, (unsigned long)ntrees, nworkers);
 
-	l = 0;
-	for(c = t->head; c; c = c->next) {
-		puts(c->item);
-		l++;
+	for(i = 0; nruns - i > MERGE_MAX; i += MERGE_MAX) {
+		run = merge_runs(runs + i, MERGE_MAX);
+		runs = xrealloc(runs, (nruns + 1) * sizeof *runs);
+		runs[nruns++] = run;
 	}
-	fprintf(stderr, "Wrote %d lines, depth %d\n", l, t->top?t->top->depth:0);
 
-	for(; l; l--)
-		avl_delete(t, t->top);
-	if(!t->top) fprintf(stderr, "Deleted all lines\n");
+	sources = xmalloc((MERGE_MAX + ntrees) * sizeof *sources);
+	memset(sources, 0, (MERGE_MAX + ntrees) * sizeof *sources);
+
+	nsources = 0;
+	for(j = i; j < nruns; j++)
+		source_open(sources + nsources++, runs[j]);
+	for(c = 0; c < nworkers; c++)
+		for(i = 0; i < workers[c].ntrees; i++)
+			sources[nsources++].next = workers[c].trees[i].head;
 
-	avl_tree_purge(t);
+	setvbuf(stdout, xmalloc(IO_BUFSIZE), _IOFBF, IO_BUFSIZE);
+	merge(sources, nsources, stdout);
+	if(fflush(stdout))
+		die("write");
 
 	return 0;
 }
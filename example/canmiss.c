@@ -139,7 +139,7 @@ static bool overtocht_info(overtocht_info_t *oi, const toestand_t *van, const to
 }
 
 static int toestand_cmp(const toestand_t *a, const toestand_t *b) {
-	return avl_unsigned_int_cmp(b->totaal, a->totaal);
+	return AVL_CMP(b->totaal, a->totaal);
 }
 
 static avl_tree_t toestanden = AVL_TREE_INITIALIZER((avl_cmp_t)toestand_cmp, NULL);
@@ -20,68 +20,113 @@
 	and a copy of the GNU Lesser General Public License along with
 	libavl.  If not, see <http://www.gnu.org/licenses/>.
 
+	Prints the lines of the first file that are not in the second one
+	(prefixed with -), then those of the second that are not in the
+	first (prefixed with +), both in sorted order.
+
+	The files are loaded with avl_lines_load(), which refers to the
+	lines inside a mapping of each file. Both are then walked in sorted
+	order at the same time: a file that is sorted already is walked as
+	it is, and only the other one is put in a tree.
+
 *****************************************************************************/
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include "avl.h"
 
-static void readinto(avl_tree_t *t, char *fname) {
-	FILE *f;
-	char *s, *e;
-	int len;
+/* Walks the lines of a file in sorted order. */
+typedef struct walk {
+	avl_lines_t *lines;
+	unsigned long index;
+	avl_node_t *node;
+} walk_t;
 
-	f = fopen(fname, "r");
-	if(!f) {
+static void load(avl_lines_t *lines, const char *fname) {
+	int fd;
+
+	fd = strcmp(fname, "-") ? open(fname, O_RDONLY) : STDIN_FILENO;
+	if(fd == -1 || avl_lines_load(lines, fd)) {
 		perror(fname);
-		exit(1);
+		exit(2);
 	}
+	if(fd != STDIN_FILENO)
+		close(fd);
 
-	for(;;) {
-		s = malloc(65536);
-		if(!s) {
-			perror("malloc()");
-			exit(2);
-		}
-		if(!fgets(s, 65536, f)) {
-			free(s);
-			break;
+	if(!lines->sorted && !avl_lines_tree(lines)) {
+		perror("malloc()");
+		exit(2);
+	}
+}
+
+static void walk_init(walk_t *w, avl_lines_t *lines) {
+	w->lines = lines;
+	w->index = 0;
+	w->node = lines->tree.head;
+}
+
+static const avl_bytes_t *walk_next(walk_t *w) {
+	const avl_bytes_t *line;
+
+	if(w->lines->sorted)
+		return w->index < w->lines->count
+			? w->lines->lines + w->index++
+			: NULL;
+
+	if(!w->node)
+		return NULL;
+	line = w->node->item;
+	w->node = avl_next(w->node);
+	return line;
+}
+
+/* Prints the lines of a that are not in b. */
+static void diff(avl_lines_t *a, avl_lines_t *b, int sign) {
+	walk_t wa, wb;
+	const avl_bytes_t *x, *y;
+	int c = 1;
+
+	walk_init(&wa, a);
+	walk_init(&wb, b);
+	y = walk_next(&wb);
+
+	while((x = walk_next(&wa))) {
+		while(y && (c = avl_bytes_cmp(y, x, NULL)) < 0)
+			y = walk_next(&wb);
+		if(!y || c) {
+			putchar(sign);
+			fwrite(x->data, 1, x->size, stdout);
+			putchar('\n');
 		}
-		len = strlen(s);
-		if(s[len-1] == '\n')
-			s[len-1] = '\0';
-		else
-			len++;
-		e = realloc(s, len);
-		if(e)
-			s = e;
-		avl_item_insert_somewhere(t, s);
 	}
-	fclose(f);
 }
 
 int main(int argc, char **argv) {
-	avl_tree_t u = AVL_TREE_INITIALIZER((avl_cmp_t)strcmp, NULL);
-	avl_tree_t t = AVL_TREE_INITIALIZER((avl_cmp_t)strcmp, NULL);
-	avl_node_t *c;
+	avl_lines_t t, u;
 
 	if(argc != 3) {
 		fprintf(stderr, "Requires exactly 2 arguments.\n");
 		exit(2);
 	}
 
-	readinto(&t, argv[1]);
-	readinto(&u, argv[2]);
+	load(&t, argv[1]);
+	load(&u, argv[2]);
+
+	diff(&t, &u, '-');
+	diff(&u, &t, '+');
 
-	for(c = t.head; c; c = c->next)
-		if(!avl_search(&u, c->item))
-			printf("-%s\n", (char *)c->item);
+	if(fflush(stdout)) {
+		perror("write");
+		exit(2);
+	}
 
-	for(c = u.head; c; c = c->next)
-		if(!avl_search(&t, c->item))
-			printf("+%s\n", (char *)c->item);
+	avl_lines_free(&t);
+	avl_lines_free(&u);
 
 	return 0;
 }
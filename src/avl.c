@@ -31,6 +31,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
 #include <errno.h>
 
 #define AVL_INLINE
@@ -38,13 +41,63 @@
 
 #include "avl.h"
 
+#if AVL_HAVE_POSIX
+#include <pthread.h>
+#endif
+
+static void avl_balance_node(avl_node_t **, avl_node_t *);
 static void avl_rebalance(avl_tree_t *, avl_node_t *);
+static void avl_rebalance_insert(avl_tree_t *, avl_node_t *, const avl_node_t *);
+static void avl_rebalance_path(avl_node_t ***, int);
+static void avl_clone_free(avl_tree_t *, avl_node_t *);
+static avl_node_t *avl_unlink_end(avl_tree_t *, int);
+
+/* The number of copies of the item that a node represents. */
+#ifdef AVL_MULTISET
+#define NODE_MULT(n)   ((n)->multiplicity)
+#else
+#define NODE_MULT(n)   1
+#endif
 
 #ifdef AVL_COUNT
 #define NODE_COUNT(n)  ((n) ? (n)->count : 0)
 #define L_COUNT(n)     (NODE_COUNT((n)->left))
 #define R_COUNT(n)     (NODE_COUNT((n)->right))
-#define CALC_COUNT(n)  (L_COUNT(n) + R_COUNT(n) + 1)
+#define CALC_COUNT(n)  (L_COUNT(n) + R_COUNT(n) + NODE_MULT(n))
+#define L_WEIGHT(n)    (L_COUNT(n) + 1)
+#define R_WEIGHT(n)    (R_COUNT(n) + 1)
+#endif
+
+/* Parameters for weight balancing (when balancing on counts only).
+ * Hirai and Yamamoto ("Balancing weight-balanced trees", 2011) show
+ * that <3,2> is the only integer pair for which a single or double
+ * rotation per node always restores the balance after an insert or
+ * delete. */
+#define AVL_WEIGHT_DELTA 3
+#define AVL_WEIGHT_GAMMA 2
+
+#ifdef AVL_NO_LIST
+#define NODE_NEXT(n)   (avl_next(n))
+#define NODE_PREV(n)   (avl_prev(n))
+#else
+#define NODE_NEXT(n)   ((n)->next)
+#define NODE_PREV(n)   ((n)->prev)
+#endif
+
+/* Upper bound on the height of a tree, for the path stacks. AVL trees
+ * are at most 1.44 lg n high, weight balanced ones 2.41 lg n. */
+#define AVL_MAX_HEIGHT 160
+
+/* Batches larger than 1/AVL_BATCH_MERGE_RATIO of the tree are merged
+ * in instead of inserted one by one. */
+#ifndef AVL_BATCH_MERGE_RATIO
+#define AVL_BATCH_MERGE_RATIO 8
+#endif
+
+/* Length of the runs that avl_tree_resort() sorts by insertion before
+ * merging them. */
+#ifndef AVL_SORT_RUN
+#define AVL_SORT_RUN 16
 #endif
 
 #ifdef AVL_DEPTH
@@ -54,6 +107,12 @@ static void avl_rebalance(avl_tree_t *, avl_node_t *);
 #define CALC_DEPTH(n)  ((unsigned char)((L_DEPTH(n) > R_DEPTH(n) ? L_DEPTH(n) : R_DEPTH(n)) + 1))
 #endif
 
+#ifdef AVL_MERKLE
+#define NODE_DIGEST(n) ((n) ? (n)->digest : 0UL)
+#define OWN_DIGEST(n)  ((n)->hash * NODE_MULT(n))
+#define CALC_DIGEST(n) (NODE_DIGEST((n)->left) + NODE_DIGEST((n)->right) + OWN_DIGEST(n))
+#endif
+
 const avl_node_t avl_node_0 = {0};
 const avl_tree_t avl_tree_0 = {0};
 const avl_allocator_t avl_allocator_0 = {0};
@@ -93,21 +152,19 @@ static int avl_check_balance(avl_node_t *avlnode) {
 	d = R_DEPTH(avlnode) - L_DEPTH(avlnode);
 	return d < -1 ? -1 : d > 1;
 #else
-/*	int d;
- *	d = ffs(R_COUNT(avlnode)) - ffs(L_COUNT(avlnode));
- *	d = d < -1 ? -1 : d > 1;
- */
 #ifdef AVL_COUNT
-	int pl, r;
+	/* Weight balanced: neither subtree may weigh (count + 1) more
+	 * than AVL_WEIGHT_DELTA times the other one. */
+	unsigned long wl, wr;
 
-	pl = ffs(L_COUNT(avlnode));
-	r = R_COUNT(avlnode);
+	wl = L_WEIGHT(avlnode);
+	wr = R_WEIGHT(avlnode);
 
-	if(r >> pl + 1)
+	if(wr > AVL_WEIGHT_DELTA * wl)
 		return 1;
-	if(pl < 2 || r >> pl - 2)
-		return 0;
-	return -1;
+	if(wl > AVL_WEIGHT_DELTA * wr)
+		return -1;
+	return 0;
 #else
 #error No balancing possible.
 #endif
@@ -135,9 +192,9 @@ avl_node_t *avl_at(const avl_tree_t *avltree, unsigned long index) {
 
 		if(index < c) {
 			avlnode = avlnode->left;
-		} else if(index > c) {
+		} else if(index >= c + NODE_MULT(avlnode)) {
+			index -= c + NODE_MULT(avlnode);
 			avlnode = avlnode->right;
-			index -= c+1;
 		} else {
 			return avlnode;
 		}
@@ -156,12 +213,165 @@ unsigned long avl_index(const avl_node_t *avlnode) {
 
 	while((next = avlnode->parent)) {
 		if(avlnode == next->right)
-			c += L_COUNT(next) + 1;
+			c += L_COUNT(next) + NODE_MULT(next);
 		avlnode = next;
 	}
 
 	return c;
 }
+
+static void avl_at_many_r(const avl_node_t *avlnode, unsigned long base, const unsigned long *ranks, unsigned long k, avl_node_t **out) {
+	unsigned long c, m, i, j, lo, hi;
+
+	while(k) {
+		if(!avlnode) {
+			for(i = 0; i < k; i++)
+				out[i] = NULL;
+			return;
+		}
+
+		c = base + L_COUNT(avlnode);
+
+		/* ranks[0..i) go left, ranks[i..j) are this node */
+		m = c + NODE_MULT(avlnode);
+		lo = 0;
+		hi = k;
+		while(lo < hi) {
+			i = lo + (hi - lo) / 2;
+			if(ranks[i] < c)
+				lo = i + 1;
+			else
+				hi = i;
+		}
+		if(lo == k) {
+			/* All of them are to the left. */
+			avlnode = avlnode->left;
+			continue;
+		}
+		for(i = j = lo; j < k && ranks[j] < m; j++)
+			out[j] = avl_const_node(avlnode);
+
+		if(i)
+			avl_at_many_r(avlnode->left, base, ranks, i, out);
+
+		avlnode = avlnode->right;
+		base = m;
+		ranks += j;
+		out += j;
+		k -= j;
+	}
+}
+
+void avl_at_many(const avl_tree_t *avltree, const unsigned long *ranks, unsigned long k, avl_node_t **out) {
+	avl_at_many_r(avltree ? avltree->top : NULL, 0, ranks, k, out);
+}
+
+void avl_index_many(avl_node_t *const *nodes, unsigned long k, unsigned long *out) {
+	const avl_node_t *prev = NULL, *a, *b;
+	unsigned long i, index = 0, ra, rb;
+
+	for(i = 0; i < k; i++) {
+		b = nodes[i];
+		if(!b) {
+			out[i] = 0;
+			continue;
+		}
+
+		if(!prev) {
+			index = avl_index(b);
+		} else {
+			/* Climb from both nodes to their lowest common ancestor,
+			 * keeping track of their ranks within the subtree that
+			 * was reached. Counts strictly increase going up, so the
+			 * node with the smaller count is never the ancestor. */
+			a = prev;
+			ra = L_COUNT(a);
+			rb = L_COUNT(b);
+			while(a != b) {
+				if(NODE_COUNT(a) <= NODE_COUNT(b)) {
+					if(a == a->parent->right)
+						ra += L_COUNT(a->parent) + NODE_MULT(a->parent);
+					a = a->parent;
+				} else {
+					if(b == b->parent->right)
+						rb += L_COUNT(b->parent) + NODE_MULT(b->parent);
+					b = b->parent;
+				}
+			}
+			index = index - ra + rb;
+		}
+
+		out[i] = index;
+		prev = nodes[i];
+	}
+}
+
+void avl_quantiles(const avl_tree_t *avltree, const double *q, unsigned long k, avl_node_t **out) {
+	unsigned long ranks[64];
+	unsigned long n, i, j;
+	double r;
+
+	n = avl_count(avltree);
+
+	for(i = 0; i < k; i += j) {
+		for(j = 0; j < 64 && i + j < k; j++) {
+			r = q[i + j] * n;
+			/* Written so that NaN ends up at rank 0 too. */
+			ranks[j] = !(r > 0) ? 0
+				: r >= n ? n - 1
+				: (unsigned long)r;
+		}
+		avl_at_many(avltree, ranks, j, out + i);
+	}
+}
+#endif
+
+#ifdef AVL_NO_LIST
+avl_node_t *avl_next(const avl_node_t *avlnode) {
+	const avl_node_t *next;
+
+	if(!avlnode)
+		return NULL;
+
+	next = avlnode->right;
+	if(next) {
+		while(next->left)
+			next = next->left;
+		return avl_const_node(next);
+	}
+
+	while((next = avlnode->parent) && avlnode == next->right)
+		avlnode = next;
+
+	return avl_const_node(next);
+}
+
+avl_node_t *avl_prev(const avl_node_t *avlnode) {
+	const avl_node_t *prev;
+
+	if(!avlnode)
+		return NULL;
+
+	prev = avlnode->left;
+	if(prev) {
+		while(prev->right)
+			prev = prev->right;
+		return avl_const_node(prev);
+	}
+
+	while((prev = avlnode->parent) && avlnode == prev->left)
+		avlnode = prev;
+
+	return avl_const_node(prev);
+}
+#else
+avl_node_t *avl_next(const avl_node_t *avlnode) {
+	return avlnode ? avlnode->next : NULL;
+}
+
+avl_node_t *avl_prev(const avl_node_t *avlnode) {
+	return avlnode ? avlnode->prev : NULL;
+}
 #endif
 
 static const avl_node_t *avl_search_leftmost_equal(const avl_tree_t *tree, const avl_node_t *node, const void *item) {
@@ -253,34 +463,22 @@ static avl_node_t *avl_search_leftish(const avl_tree_t *tree, const void *item,
 			if(node->right)
 				node = node->right;
 			else
-				return *exact = 0, node->next;
+				return *exact = 0, NODE_NEXT(node);
 		} else {
 			return *exact = 1, node;
 		}
 	}
 }
 
-/* Searches for an item, returning either some exact
- * match, or (if no exact match could be found) the last (rightmost)
- * of the nodes that have an item smaller than the search item.
- * If exact is not NULL, *exact will be set to:
- *    0  if the returned node is inequal or NULL
- *    1  if the returned node is equal
- * Returns NULL if no equal or smaller element could be found.
+/* Like avl_search_rightish(), but starts the descent at the given node
+ * instead of at the top of the tree. The item must be within the range
+ * of the subtree rooted at that node.
  * O(lg n) */
-static avl_node_t *avl_search_rightish(const avl_tree_t *tree, const void *item, int *exact) {
-	avl_node_t *node;
+static avl_node_t *avl_descend_rightish(const avl_tree_t *tree, avl_node_t *node, const void *item, int *exact) {
 	avl_cmp_t cmp;
 	void *userdata;
 	int c;
 
-	if(!exact)
-		exact = &c;
-
-	if(!tree)
-		return *exact = 0, (avl_node_t *)NULL;
-
-	node = tree->top;
 	if(!node)
 		return *exact = 0, (avl_node_t *)NULL;
 
@@ -294,7 +492,7 @@ static avl_node_t *avl_search_rightish(const avl_tree_t *tree, const void *item,
 			if(node->left)
 				node = node->left;
 			else
-				return *exact = 0, node->prev;
+				return *exact = 0, NODE_PREV(node);
 		} else if(c > 0) {
 			if(node->right)
 				node = node->right;
@@ -306,6 +504,26 @@ static avl_node_t *avl_search_rightish(const avl_tree_t *tree, const void *item,
 	}
 }
 
+/* Searches for an item, returning either some exact
+ * match, or (if no exact match could be found) the last (rightmost)
+ * of the nodes that have an item smaller than the search item.
+ * If exact is not NULL, *exact will be set to:
+ *    0  if the returned node is inequal or NULL
+ *    1  if the returned node is equal
+ * Returns NULL if no equal or smaller element could be found.
+ * O(lg n) */
+static avl_node_t *avl_search_rightish(const avl_tree_t *tree, const void *item, int *exact) {
+	int c;
+
+	if(!exact)
+		exact = &c;
+
+	if(!tree)
+		return *exact = 0, (avl_node_t *)NULL;
+
+	return avl_descend_rightish(tree, tree->top, item, exact);
+}
+
 avl_node_t *avl_search_left(const avl_tree_t *tree, const void *item, int *exact) {
 	avl_node_t *node;
 	int c;
@@ -365,307 +583,2398 @@ int avl_search_closest_FIXME(const avl_tree_t *tree, const void *item, avl_node_
 	return e;
 }
 
-avl_node_t *avl_search(const avl_tree_t *avltree, const void *item) {
-	int c;
-	avl_node_t *n;
-	n = avl_search_rightish(avltree, item, &c);
-	return c ? n : NULL;
-}
+/* The exact match index: open addressing with linear probing. Every
+ * slot caches the (mixed) hash of its item so that probes rarely need
+ * to call the compare function and resizing never calls the user's
+ * hash function. Removal shifts entries back instead of leaving
+ * tombstones. */
 
-avl_tree_t *avl_tree_init(avl_tree_t *avltree, avl_cmp_t cmp, avl_free_t free) {
-	if(avltree) {
-		avltree->head = NULL;
-		avltree->tail = NULL;
-		avltree->top = NULL;
-		avltree->cmp = cmp;
-		avltree->free = free;
-	}
-	return avltree;
+#define AVL_HASH_MIN_SIZE 16
+
+struct avl_hash_slot {
+	unsigned long hash;
+	avl_node_t *node;
+};
+
+struct avl_hash_index {
+	avl_hash_t hash;
+	unsigned long mask;
+	unsigned long used;
+	struct avl_hash_slot *slots;
+};
+
+/* Spreads the bits of weak user hashes (like the identity on integers)
+ * over the table. */
+static unsigned long avl_hash_mix(unsigned long h) {
+	h ^= h >> 16;
+	h *= 0x45d9f3bUL;
+	h ^= h >> 16;
+	h *= 0x45d9f3bUL;
+	h ^= h >> 16;
+	return h;
 }
 
-avl_tree_t *avl_tree_malloc(avl_cmp_t cmp, avl_free_t free) {
-	return avl_tree_init(malloc(sizeof(avl_tree_t)), cmp, free);
+static unsigned long avl_hash_item(const avl_tree_t *avltree, const void *item) {
+	return avl_hash_mix(avltree->hash->hash(item, avltree->userdata));
 }
 
-avl_tree_t *avl_tree_clear(avl_tree_t *avltree) {
-	if(avltree)
-		avltree->top = avltree->head = avltree->tail = NULL;
-	return avltree;
+#ifdef AVL_MERKLE
+/* Spreads user hashes over all bits, so that their sums collide no
+ * more often than the hashes themselves. The offset keeps a hash of 0
+ * from dropping out of the sums. */
+static unsigned long avl_merkle_mix(unsigned long h) {
+#	if ULONG_MAX > 0xFFFFFFFFUL
+	h += 0x9E3779B97F4A7C15UL;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDUL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53UL;
+	h ^= h >> 33;
+#	else
+	h = avl_hash_mix(h + 0x9E3779B9UL);
+#	endif
+	return h;
 }
 
-static void avl_node_free(avl_tree_t *avltree, avl_node_t *node) {
-	avl_allocator_t *allocator;
-	avl_deallocate_t deallocate;
+static unsigned long avl_merkle_hash(const avl_tree_t *avltree, const void *item) {
+	return avl_merkle_mix(avltree->merkle
+		? avltree->merkle(item, avltree->userdata)
+		: (unsigned long)(uintptr_t)item);
+}
 
-	allocator = avltree->allocator;
-	if(allocator) {
-		deallocate = allocator->deallocate;
-		if(deallocate)
-			deallocate(allocator, node);
-	} else {
-		free(node);
-	}
+/* Hashes the item of a node that is about to be linked in as a leaf. */
+static void avl_merkle_set(const avl_tree_t *avltree, avl_node_t *avlnode) {
+	avlnode->hash = avl_merkle_hash(avltree, avlnode->item);
+	avlnode->digest = OWN_DIGEST(avlnode);
 }
 
-avl_tree_t *avl_tree_purge(avl_tree_t *avltree) {
-	avl_node_t *node, *next;
-	avl_free_t func;
-	avl_allocator_t *allocator;
-	avl_deallocate_t deallocate;
-	void *userdata;
+/* Rehashes the item of a node in the tree, and corrects the digests of
+ * the subtrees that contain it.
+ * O(lg n) */
+static void avl_merkle_rehash(const avl_tree_t *avltree, avl_node_t *avlnode) {
+	unsigned long delta = OWN_DIGEST(avlnode);
 
-	if(!avltree)
-		return NULL;
+	avlnode->hash = avl_merkle_hash(avltree, avlnode->item);
+	delta = OWN_DIGEST(avlnode) - delta;
+	for(; avlnode; avlnode = avlnode->parent)
+		avlnode->digest += delta;
+}
+#else
+#define avl_merkle_set(t, n)
+#define avl_merkle_rehash(t, n)
+#endif
 
-	userdata = avltree->userdata;
+static void avl_hash_put(struct avl_hash_index *index, unsigned long h, avl_node_t *node) {
+	struct avl_hash_slot *slots = index->slots;
+	unsigned long mask = index->mask;
+	unsigned long i;
 
-	func = avltree->free;
-	allocator = avltree->allocator;
-	deallocate = allocator
-		? allocator->deallocate
-		: (avl_deallocate_t)NULL;
+	for(i = h & mask; slots[i].node; i = (i + 1) & mask);
+	slots[i].hash = h;
+	slots[i].node = node;
+}
 
-	for(node = avltree->head; node; node = next) {
-		next = node->next;
-		if(func)
-			func(node->item, userdata);
-		if(allocator) {
-			if(deallocate)
-				deallocate(allocator, node);
-		} else {
-			free(node);
-		}
-	}
+/* Returns the slot that refers to node, or NULL. */
+static struct avl_hash_slot *avl_hash_slot(struct avl_hash_index *index, unsigned long h, const avl_node_t *node) {
+	struct avl_hash_slot *slots = index->slots;
+	unsigned long mask = index->mask;
+	unsigned long i;
 
-	return avl_tree_clear(avltree);
+	for(i = h & mask; slots[i].node; i = (i + 1) & mask)
+		if(slots[i].node == node)
+			return slots + i;
+	return NULL;
 }
 
-void avl_tree_free(avl_tree_t *avltree) {
-	if(!avltree)
-		return;
-	(void)avl_tree_purge(avltree);
-	free(avltree);
+static int avl_hash_resize(struct avl_hash_index *index, unsigned long size) {
+	struct avl_hash_slot *old, *slots;
+	unsigned long i, oldsize;
+
+	slots = calloc(size, sizeof *slots);
+	if(!slots)
+		return errno = ENOMEM, -1;
+
+	old = index->slots;
+	oldsize = old ? index->mask + 1 : 0;
+	index->slots = slots;
+	index->mask = size - 1;
+
+	for(i = 0; i < oldsize; i++)
+		if(old[i].node)
+			avl_hash_put(index, old[i].hash, old[i].node);
+	free(old);
+
+	return 0;
 }
 
-static void avl_node_clear(avl_node_t *newnode) {
-	newnode->left = newnode->right = NULL;
-#	ifdef AVL_COUNT
-	newnode->count = 1;
-#	endif
-#	ifdef AVL_DEPTH
-	newnode->depth = 1;
-#	endif
+/* Makes sure that extra more nodes fit in the index without going over
+ * a load factor of 3/4, so that adding them can't fail halfway through
+ * an insert. */
+static int avl_hash_reserve(avl_tree_t *avltree, unsigned long extra) {
+	struct avl_hash_index *index = avltree->hash;
+	unsigned long size, need;
+
+	if(!index)
+		return 0;
+
+	need = index->used + extra;
+	size = index->mask + 1;
+	if(need <= size / 4 * 3)
+		return 0;
+	while(need > size / 4 * 3)
+		size <<= 1;
+
+	return avl_hash_resize(index, size);
 }
 
-avl_node_t *avl_node_init(avl_node_t *newnode, const void *item) {
-	if(newnode)
-		newnode->item = avl_const_item(item);
-	return newnode;
+static void avl_hash_add(avl_tree_t *avltree, avl_node_t *avlnode) {
+	struct avl_hash_index *index = avltree->hash;
+
+	if(!index)
+		return;
+
+	avl_hash_put(index, avl_hash_item(avltree, avlnode->item), avlnode);
+	index->used++;
 }
 
-avl_node_t *avl_alloc(avl_tree_t *avltree, const void *item) {
-	avl_node_t *newnode;
-	avl_allocator_t *allocator = avltree
-		? avltree->allocator
-		: (avl_allocator_t *)NULL;
-	avl_allocate_t allocate;
-	if(allocator) {
-		allocate = allocator->allocate;
-		if(allocator) {
-			newnode = allocate(allocator);
-		} else {
-			errno = ENOSYS;
-			newnode = NULL;
-		}
-	} else {
-		newnode = malloc(sizeof *newnode);
+static void avl_hash_remove(avl_tree_t *avltree, avl_node_t *avlnode) {
+	struct avl_hash_index *index = avltree->hash;
+	struct avl_hash_slot *slots, *slot;
+	unsigned long mask, i, j, k;
+
+	if(!index)
+		return;
+
+	slot = avl_hash_slot(index, avl_hash_item(avltree, avlnode->item), avlnode);
+	if(!slot)
+		return;
+
+	slots = index->slots;
+	mask = index->mask;
+	i = slot - slots;
+
+	/* Move later entries of the same cluster into the hole, unless
+	 * their home slot lies cyclically between the hole and them. */
+	for(j = (i + 1) & mask; slots[j].node; j = (j + 1) & mask) {
+		k = slots[j].hash & mask;
+		if(i <= j ? i < k && k <= j : i < k || k <= j)
+			continue;
+		slots[i] = slots[j];
+		i = j;
 	}
-	return avl_node_init(newnode, item);
+
+	slots[i].node = NULL;
+	index->used--;
 }
 
-/* For backwards compatibility. */
-avl_node_t *avl_node_malloc_FIXME(const void *item) {
-	return avl_alloc(NULL, item);
+/* Replaces oldnode by newnode in the index, for avl_fixup(). */
+static void avl_hash_move(avl_tree_t *avltree, const avl_node_t *oldnode, avl_node_t *newnode) {
+	struct avl_hash_slot *slot;
+
+	if(!avltree->hash)
+		return;
+
+	slot = avl_hash_slot(avltree->hash, avl_hash_item(avltree, newnode->item), oldnode);
+	if(slot)
+		slot->node = newnode;
 }
 
-/* Insert a node in an empty tree. If avlnode is NULL, the tree will be
- * cleared and ready for re-use.
- * If the tree is not empty, the old nodes are left dangling.
- * O(1) */
-static avl_node_t *avl_insert_top(avl_tree_t *avltree, avl_node_t *newnode) {
-	avl_node_clear(newnode);
-	newnode->prev = newnode->next = newnode->parent = NULL;
-	avltree->head = avltree->tail = avltree->top = newnode;
-	return newnode;
+static void avl_hash_clear(avl_tree_t *avltree) {
+	struct avl_hash_index *index = avltree->hash;
+	unsigned long i;
+
+	if(!index)
+		return;
+
+	for(i = 0; i <= index->mask; i++)
+		index->slots[i].node = NULL;
+	index->used = 0;
 }
 
-avl_node_t *avl_insert_top_FIXME(avl_tree_t *avltree, avl_node_t *newnode) {
-	return avl_insert_top(avltree, newnode);
+/* Tells the hooks of the tree, if any, about a node. */
+static void avl_hook_inserted(avl_tree_t *avltree, avl_node_t *avlnode) {
+	avl_hooks_t *hooks = avltree->hooks;
+
+	if(hooks && hooks->inserted)
+		hooks->inserted(hooks, avltree, avlnode);
 }
 
-avl_node_t *avl_insert_before(avl_tree_t *avltree, avl_node_t *node, avl_node_t *newnode) {
-	if(!avltree || !newnode)
-		return NULL;
+static void avl_hook_unlinked(avl_tree_t *avltree, avl_node_t *avlnode) {
+	avl_hooks_t *hooks = avltree->hooks;
 
-	if(!node)
-		return avltree->tail
-			? avl_insert_after(avltree, avltree->tail, newnode)
-			: avl_insert_top(avltree, newnode);
+	if(hooks && hooks->unlinked)
+		hooks->unlinked(hooks, avltree, avlnode);
+}
 
-	if(node->left)
-		return avl_insert_after(avltree, node->prev, newnode);
+static void avl_hook_deleted(avl_tree_t *avltree, avl_node_t *avlnode) {
+	avl_hooks_t *hooks = avltree->hooks;
 
-	avl_node_clear(newnode);
+	if(hooks && hooks->deleted)
+		hooks->deleted(hooks, avltree, avlnode);
+}
 
-	newnode->next = node;
-	newnode->parent = node;
+static avl_node_t *avl_hash_search(const avl_tree_t *avltree, const void *item) {
+	struct avl_hash_index *index = avltree->hash;
+	struct avl_hash_slot *slots = index->slots;
+	unsigned long mask = index->mask;
+	avl_cmp_t cmp = avltree->cmp;
+	void *userdata = avltree->userdata;
+	unsigned long h, i;
+	avl_node_t *node;
 
-	newnode->prev = node->prev;
-	if(node->prev)
+	h = avl_hash_item(avltree, item);
+	for(i = h & mask; (node = slots[i].node); i = (i + 1) & mask)
+		if(slots[i].hash == h && !cmp(item, node->item, userdata))
+			return node;
+
+	return NULL;
+}
+
+int avl_tree_hash_index(avl_tree_t *avltree, avl_hash_t hash) {
+	struct avl_hash_index *index, *old;
+	avl_node_t *node;
+	unsigned long size, n = 0;
+
+	if(!avltree)
+		return errno = EFAULT, -1;
+
+	index = NULL;
+	if(hash) {
+		for(node = avltree->head; node; node = NODE_NEXT(node))
+			n++;
+		size = AVL_HASH_MIN_SIZE;
+		while(n > size / 4 * 3)
+			size <<= 1;
+
+		index = malloc(sizeof *index);
+		if(!index)
+			return -1;
+		index->hash = hash;
+		index->used = n;
+		index->slots = NULL;
+		if(avl_hash_resize(index, size)) {
+			free(index);
+			return -1;
+		}
+	}
+
+	old = avltree->hash;
+	if(old) {
+		free(old->slots);
+		free(old);
+	}
+
+	avltree->hash = index;
+	for(node = avltree->head; index && node; node = NODE_NEXT(node))
+		avl_hash_put(index, avl_hash_item(avltree, node->item), node);
+
+	return 0;
+}
+
+unsigned long avl_strhash(const void *item, void *userdata) {
+	const unsigned char *s = item;
+	unsigned long h = 2166136261UL;
+
+	while(*s)
+		h = (h ^ *s++) * 16777619UL;
+
+	return h;
+}
+
+avl_node_t *avl_search(const avl_tree_t *avltree, const void *item) {
+	int c;
+	avl_node_t *n;
+	if(avltree && avltree->hash)
+		return avl_hash_search(avltree, item);
+	n = avl_search_rightish(avltree, item, &c);
+	return c ? n : NULL;
+}
+
+/* Checks the subtree below avlnode, in order, so that the list links
+ * and the order of the items can be compared with those of the node
+ * visited before it (*prev). The counts and depths of the children are
+ * checked before those of their parent, so checking each node against
+ * its children is enough. */
+static int avl_verify_node(const avl_tree_t *avltree, const avl_node_t *avlnode, const avl_node_t *parent, int level, const avl_node_t **prev, unsigned long *n) {
+	if(!avlnode)
+		return 0;
+
+	if(level >= AVL_MAX_HEIGHT || avlnode->parent != parent)
+		return -1;
+
+	if(avl_verify_node(avltree, avlnode->left, avlnode, level + 1, prev, n))
+		return -1;
+
+	if(*prev && avltree->cmp
+	&& avltree->cmp((*prev)->item, avlnode->item, avltree->userdata) > 0)
+		return -1;
+#ifndef AVL_NO_LIST
+	if(avlnode->prev != *prev || (*prev ? (*prev)->next : avltree->head) != avlnode)
+		return -1;
+#else
+	if(!*prev && avltree->head != avlnode)
+		return -1;
+#endif
+	if(avltree->hash && !avl_hash_slot(avltree->hash, avl_hash_item(avltree, avlnode->item), avlnode))
+		return -1;
+	*prev = avlnode;
+	++*n;
+
+	if(avl_verify_node(avltree, avlnode->right, avlnode, level + 1, prev, n))
+		return -1;
+
+#ifdef AVL_MULTISET
+	if(!avlnode->multiplicity)
+		return -1;
+#endif
+#ifdef AVL_COUNT
+	if(avlnode->count != CALC_COUNT(avlnode))
+		return -1;
+#endif
+#ifdef AVL_DEPTH
+	if(avlnode->depth != CALC_DEPTH(avlnode))
+		return -1;
+#endif
+#ifdef AVL_MERKLE
+	if(avlnode->digest != CALC_DIGEST(avlnode))
+		return -1;
+#endif
+	return avl_check_balance(avl_const_node(avlnode)) ? -1 : 0;
+}
+
+int avl_tree_verify(const avl_tree_t *avltree) {
+	const avl_node_t *last = NULL;
+	unsigned long n = 0;
+
+	if(!avltree)
+		return errno = EFAULT, -1;
+
+	if(avl_verify_node(avltree, avltree->top, NULL, 0, &last, &n)
+	|| avltree->tail != last
+	|| (!last && avltree->head)
+#ifndef AVL_NO_LIST
+	|| (last && last->next)
+#endif
+	|| (avltree->hash && avltree->hash->used != n))
+		return errno = EINVAL, -1;
+
+	return 0;
+}
+
+#ifdef AVL_MERKLE
+/* Hashes the items of a subtree anew, children first.
+ * O(n) */
+static void avl_merkle_subtree(const avl_tree_t *avltree, avl_node_t *avlnode) {
+	if(!avlnode)
+		return;
+	avl_merkle_subtree(avltree, avlnode->left);
+	avl_merkle_subtree(avltree, avlnode->right);
+	avl_merkle_set(avltree, avlnode);
+	avlnode->digest = CALC_DIGEST(avlnode);
+}
+
+void avl_tree_merkle(avl_tree_t *avltree, avl_hash_t hash) {
+	if(!avltree)
+		return;
+	avltree->merkle = hash;
+	avl_merkle_subtree(avltree, avltree->top);
+}
+
+unsigned long avl_tree_digest(const avl_tree_t *avltree) {
+	return avltree ? NODE_DIGEST(avltree->top) : 0UL;
+}
+
+/* Returns the digest of the items less than item (or, if inclusive is
+ * set, less than or equal to it).
+ * O(lg n) */
+static unsigned long avl_merkle_below(const avl_tree_t *avltree, const void *item, int inclusive) {
+	const avl_node_t *node = avltree->top;
+	unsigned long digest = 0;
+	int c;
+
+	while(node) {
+		c = avltree->cmp(node->item, item, avltree->userdata);
+		if(c < 0 || (!c && inclusive)) {
+			digest += NODE_DIGEST(node->left) + OWN_DIGEST(node);
+			node = node->right;
+		} else {
+			node = node->left;
+		}
+	}
+
+	return digest;
+}
+
+unsigned long avl_digest_range(const avl_tree_t *avltree, const void *from, const void *to) {
+	if(!avltree)
+		return 0UL;
+	return avl_merkle_below(avltree, to, 0) - avl_merkle_below(avltree, from, 0);
+}
+
+typedef struct avl_diff_job {
+	const avl_tree_t *b;
+	avl_diff_t diff;
+	void *userdata;
+} avl_diff_job_t;
+
+/* Returns the digest of the items of b that lie strictly between the
+ * items of lo and hi, either of which may be NULL for no bound. */
+static unsigned long avl_diff_between(const avl_diff_job_t *job, const avl_node_t *lo, const avl_node_t *hi) {
+	unsigned long digest;
+
+	digest = hi ? avl_merkle_below(job->b, hi->item, 0) : NODE_DIGEST(job->b->top);
+	if(lo)
+		digest -= avl_merkle_below(job->b, lo->item, 1);
+	return digest;
+}
+
+/* Reports the items of b strictly between lo and hi as missing in a. */
+static int avl_diff_rest(const avl_diff_job_t *job, const avl_node_t *lo, const avl_node_t *hi) {
+	const avl_tree_t *b = job->b;
+	const avl_node_t *node;
+	int r;
+
+	if(lo) {
+		node = avl_search_right(b, lo->item, NULL);
+		node = node ? NODE_NEXT(node) : b->head;
+	} else {
+		node = b->head;
+	}
+
+	for(; node; node = NODE_NEXT(node)) {
+		if(hi && b->cmp(node->item, hi->item, b->userdata) >= 0)
+			break;
+		r = job->diff(NULL, node->item, job->userdata);
+		if(r)
+			return r;
+	}
+
+	return 0;
+}
+
+/* Compares the subtree of a at avlnode, which holds the items strictly
+ * between lo and hi, with the same range of b.
+ * O(d lg^2 n) */
+static int avl_diff_node(const avl_diff_job_t *job, const avl_node_t *avlnode, const avl_node_t *lo, const avl_node_t *hi) {
+	const avl_node_t *other;
+	int r;
+
+	if(NODE_DIGEST(avlnode) == avl_diff_between(job, lo, hi))
+		return 0;
+
+	if(!avlnode)
+		return avl_diff_rest(job, lo, hi);
+
+	r = avl_diff_node(job, avlnode->left, lo, avlnode);
+	if(r)
+		return r;
+
+	other = avl_search(job->b, avlnode->item);
+	if(!other)
+		r = job->diff(avlnode->item, NULL, job->userdata);
+	else if(other->hash != avlnode->hash || NODE_MULT(other) != NODE_MULT(avlnode))
+		r = job->diff(avlnode->item, other->item, job->userdata);
+	if(r)
+		return r;
+
+	return avl_diff_node(job, avlnode->right, avlnode, hi);
+}
+
+int avl_tree_diff(const avl_tree_t *a, const avl_tree_t *b, avl_diff_t diff, void *userdata) {
+	avl_diff_job_t job;
+
+	if(!a || !b || !diff)
+		return errno = EFAULT, -1;
+	if(a->merkle != b->merkle)
+		return errno = EINVAL, -1;
+
+	job.b = b;
+	job.diff = diff;
+	job.userdata = userdata;
+
+	return avl_diff_node(&job, a->top, NULL, NULL);
+}
+#endif
+
+#ifdef __GNUC__
+#define avl_prefetch(x) __builtin_prefetch(x)
+#else
+#define avl_prefetch(x) ((void)0)
+#endif
+
+avl_cursor_t *avl_cursor_init(avl_cursor_t *cursor, const avl_tree_t *avltree, unsigned int prefetch) {
+	if(cursor) {
+		cursor->tree = avltree;
+		cursor->node = NULL;
+		cursor->first = NULL;
+		cursor->last = NULL;
+		cursor->scout = NULL;
+		cursor->prefetch = prefetch;
+		cursor->empty = 0;
+	}
+	return cursor;
+}
+
+/* Checks whether node lies before the start or after the end of the
+ * range of the cursor. Nodes with items equal to that of first or last
+ * are inside: first is the leftmost and last the rightmost of those. */
+static int avl_cursor_before(const avl_cursor_t *cursor, const avl_node_t *node) {
+	const avl_tree_t *avltree = cursor->tree;
+	return cursor->first && node != cursor->first
+		&& avltree->cmp(node->item, cursor->first->item, avltree->userdata) < 0;
+}
+
+static int avl_cursor_after(const avl_cursor_t *cursor, const avl_node_t *node) {
+	const avl_tree_t *avltree = cursor->tree;
+	return cursor->last && node != cursor->last
+		&& avltree->cmp(node->item, cursor->last->item, avltree->userdata) > 0;
+}
+
+/* Positions the cursor on node (which may be NULL) and sends the scout
+ * ahead to prefetch the nodes that follow. */
+static avl_node_t *avl_cursor_set(avl_cursor_t *cursor, avl_node_t *node) {
+	avl_node_t *scout;
+	unsigned int i;
+
+	cursor->node = node;
+
+	scout = node;
+	for(i = 0; scout && scout != cursor->last && i < cursor->prefetch; i++) {
+		scout = NODE_NEXT(scout);
+		if(scout) {
+			avl_prefetch(scout);
+			avl_prefetch(scout->item);
+		}
+	}
+	cursor->scout = scout;
+
+	return node;
+}
+
+avl_node_t *avl_cursor_range(avl_cursor_t *cursor, const void *lo, const void *hi) {
+	const avl_tree_t *avltree;
+
+	if(!cursor || !cursor->tree)
+		return NULL;
+
+	avltree = cursor->tree;
+	cursor->first = avl_search_left(avltree, lo, NULL);
+	cursor->last = avl_search_right(avltree, hi, NULL);
+	cursor->empty = !cursor->first || !cursor->last
+		|| avltree->cmp(cursor->first->item, cursor->last->item, avltree->userdata) > 0;
+
+	if(cursor->empty)
+		return avl_cursor_set(cursor, NULL);
+
+	return avl_cursor_set(cursor, cursor->first);
+}
+
+avl_node_t *avl_cursor_seek_left(avl_cursor_t *cursor, const void *item) {
+	avl_node_t *node;
+
+	if(!cursor || !cursor->tree)
+		return NULL;
+	if(cursor->empty)
+		return avl_cursor_set(cursor, NULL);
+
+	node = avl_search_left(cursor->tree, item, NULL);
+	if(node) {
+		if(avl_cursor_after(cursor, node))
+			node = NULL;
+		else if(avl_cursor_before(cursor, node))
+			node = cursor->first;
+	}
+
+	return avl_cursor_set(cursor, node);
+}
+
+avl_node_t *avl_cursor_seek_right(avl_cursor_t *cursor, const void *item) {
+	avl_node_t *node;
+
+	if(!cursor || !cursor->tree)
+		return NULL;
+	if(cursor->empty)
+		return avl_cursor_set(cursor, NULL);
+
+	node = avl_search_right(cursor->tree, item, NULL);
+	if(node) {
+		if(avl_cursor_before(cursor, node))
+			node = NULL;
+		else if(avl_cursor_after(cursor, node))
+			node = cursor->last;
+	}
+
+	return avl_cursor_set(cursor, node);
+}
+
+avl_node_t *avl_cursor_next(avl_cursor_t *cursor) {
+	avl_node_t *node, *scout;
+
+	if(!cursor)
+		return NULL;
+
+	node = cursor->node;
+	if(!node)
+		return NULL;
+
+	if(node == cursor->last)
+		return cursor->node = NULL;
+
+	scout = cursor->scout;
+	if(scout && scout != cursor->last) {
+		scout = NODE_NEXT(scout);
+		if(scout) {
+			avl_prefetch(scout);
+			avl_prefetch(scout->item);
+		}
+		cursor->scout = scout;
+	}
+
+	return cursor->node = NODE_NEXT(node);
+}
+
+avl_node_t *avl_cursor_prev(avl_cursor_t *cursor) {
+	avl_node_t *node;
+
+	if(!cursor)
+		return NULL;
+
+	node = cursor->node;
+	if(!node)
+		return NULL;
+
+	if(node == cursor->first)
+		return cursor->node = NULL;
+
+	return cursor->node = NODE_PREV(node);
+}
+
+size_t avl_cursor_fetch(avl_cursor_t *cursor, void **items, size_t max) {
+	size_t n;
+
+	if(!cursor)
+		return 0;
+
+	for(n = 0; n < max && cursor->node; n++) {
+		items[n] = cursor->node->item;
+		(void)avl_cursor_next(cursor);
+	}
+
+	return n;
+}
+
+size_t avl_cursor_fetch_back(avl_cursor_t *cursor, void **items, size_t max) {
+	size_t n;
+
+	if(!cursor)
+		return 0;
+
+	for(n = 0; n < max && cursor->node; n++) {
+		items[n] = cursor->node->item;
+		(void)avl_cursor_prev(cursor);
+	}
+
+	return n;
+}
+
+avl_tree_t *avl_tree_init(avl_tree_t *avltree, avl_cmp_t cmp, avl_free_t free) {
+	if(avltree) {
+		avltree->head = NULL;
+		avltree->tail = NULL;
+		avltree->top = NULL;
+		avltree->cmp = cmp;
+		avltree->free = free;
+		avltree->userdata = NULL;
+		avltree->allocator = NULL;
+		avltree->hash = NULL;
+		avltree->hooks = NULL;
+#		ifdef AVL_MERKLE
+		avltree->merkle = NULL;
+#		endif
+	}
+	return avltree;
+}
+
+avl_tree_t *avl_tree_malloc(avl_cmp_t cmp, avl_free_t free) {
+	return avl_tree_init(malloc(sizeof(avl_tree_t)), cmp, free);
+}
+
+/* Forgets all nodes, without telling the hooks. */
+static avl_tree_t *avl_tree_empty(avl_tree_t *avltree) {
+	avltree->top = avltree->head = avltree->tail = NULL;
+	avl_hash_clear(avltree);
+	return avltree;
+}
+
+avl_tree_t *avl_tree_clear(avl_tree_t *avltree) {
+	avl_node_t *node;
+
+	if(!avltree)
+		return NULL;
+
+	if(avltree->hooks)
+		for(node = avltree->head; node; node = NODE_NEXT(node))
+			avl_hook_unlinked(avltree, node);
+
+	return avl_tree_empty(avltree);
+}
+
+/* Converts the subtree rooted at avlnode into a list of nodes linked
+ * through their ->right pointers, in order, and appends it to *tail.
+ * Returns the ->right pointer of the last node so the caller can
+ * continue (or terminate) the list.
+ * O(n) */
+static avl_node_t **avl_flatten(avl_node_t *avlnode, avl_node_t **tail) {
+	avl_node_t *right;
+
+	while(avlnode) {
+		tail = avl_flatten(avlnode->left, tail);
+		right = avlnode->right;
+		*tail = avlnode;
+		tail = &avlnode->right;
+		avlnode = right;
+	}
+
+	return tail;
+}
+
+static void avl_node_free(avl_tree_t *avltree, avl_node_t *node) {
+	avl_allocator_t *allocator;
+	avl_deallocate_t deallocate;
+
+	allocator = avltree->allocator;
+	if(allocator) {
+		deallocate = allocator->deallocate;
+		if(deallocate)
+			deallocate(allocator, node);
+	} else {
+		free(node);
+	}
+}
+
+avl_tree_t *avl_tree_purge(avl_tree_t *avltree) {
+	avl_node_t *node, *next;
+	avl_free_t func;
+	avl_allocator_t *allocator;
+	avl_deallocate_t deallocate;
+	avl_hooks_t *hooks;
+	void *userdata;
+
+	if(!avltree)
+		return NULL;
+
+	userdata = avltree->userdata;
+	hooks = avltree->hooks;
+
+	func = avltree->free;
+	allocator = avltree->allocator;
+	deallocate = allocator
+		? allocator->deallocate
+		: (avl_deallocate_t)NULL;
+
+#	ifdef AVL_NO_LIST
+	/* The nodes can't find their successors once their predecessors
+	 * are gone, so string them together through ->right first. */
+	*avl_flatten(avltree->top, &avltree->top) = NULL;
+	for(node = avltree->top; node; node = next) {
+		next = node->right;
+#	else
+	for(node = avltree->head; node; node = next) {
+		next = node->next;
+#	endif
+		if(hooks) {
+			avl_hook_unlinked(avltree, node);
+			avl_hook_deleted(avltree, node);
+		}
+		if(func)
+			func(node->item, userdata);
+		if(allocator) {
+			if(deallocate)
+				deallocate(allocator, node);
+		} else {
+			free(node);
+		}
+	}
+
+	return avl_tree_empty(avltree);
+}
+
+void avl_tree_free(avl_tree_t *avltree) {
+	if(!avltree)
+		return;
+	(void)avl_tree_purge(avltree);
+	(void)avl_tree_hash_index(avltree, NULL);
+	free(avltree);
+}
+
+static void avl_node_clear(const avl_tree_t *avltree, avl_node_t *newnode) {
+	newnode->left = newnode->right = NULL;
+#	ifdef AVL_MULTISET
+	if(!newnode->multiplicity)
+		newnode->multiplicity = 1;
+#	endif
+#	ifdef AVL_COUNT
+	newnode->count = NODE_MULT(newnode);
+#	endif
+#	ifdef AVL_DEPTH
+	newnode->depth = 1;
+#	endif
+	avl_merkle_set(avltree, newnode);
+}
+
+avl_node_t *avl_node_init(avl_node_t *newnode, const void *item) {
+	if(newnode) {
+		newnode->item = avl_const_item(item);
+#		ifdef AVL_MULTISET
+		newnode->multiplicity = 1;
+#		endif
+	}
+	return newnode;
+}
+
+avl_node_t *avl_alloc(avl_tree_t *avltree, const void *item) {
+	avl_node_t *newnode;
+	avl_allocator_t *allocator = avltree
+		? avltree->allocator
+		: (avl_allocator_t *)NULL;
+	avl_allocate_t allocate;
+	if(allocator) {
+		allocate = allocator->allocate;
+		if(allocate) {
+			newnode = allocate(allocator);
+		} else {
+			errno = ENOSYS;
+			newnode = NULL;
+		}
+	} else {
+		newnode = malloc(sizeof *newnode);
+	}
+	return avl_node_init(newnode, item);
+}
+
+/* For backwards compatibility. */
+avl_node_t *avl_node_malloc_FIXME(const void *item) {
+	return avl_alloc(NULL, item);
+}
+
+/* Insert a node in an empty tree. If avlnode is NULL, the tree will be
+ * cleared and ready for re-use.
+ * If the tree is not empty, the old nodes are left dangling.
+ * O(1) */
+static avl_node_t *avl_insert_top(avl_tree_t *avltree, avl_node_t *newnode) {
+	avl_node_clear(avltree, newnode);
+#	ifndef AVL_NO_LIST
+	newnode->prev = newnode->next = NULL;
+#	endif
+	newnode->parent = NULL;
+	avltree->head = avltree->tail = avltree->top = newnode;
+	avl_hash_add(avltree, newnode);
+	avl_hook_inserted(avltree, newnode);
+	return newnode;
+}
+
+avl_node_t *avl_insert_top_FIXME(avl_tree_t *avltree, avl_node_t *newnode) {
+	return avl_insert_top(avltree, newnode);
+}
+
+avl_node_t *avl_insert_before(avl_tree_t *avltree, avl_node_t *node, avl_node_t *newnode) {
+	if(!avltree || !newnode)
+		return NULL;
+
+	if(avl_hash_reserve(avltree, 1))
+		return NULL;
+
+	if(!node)
+		return avltree->tail
+			? avl_insert_after(avltree, avltree->tail, newnode)
+			: avl_insert_top(avltree, newnode);
+
+	if(node->left)
+		return avl_insert_after(avltree, NODE_PREV(node), newnode);
+
+	avl_node_clear(avltree, newnode);
+
+	newnode->parent = node;
+
+#	ifdef AVL_NO_LIST
+	if(node == avltree->head)
+		avltree->head = newnode;
+#	else
+	newnode->next = node;
+	newnode->prev = node->prev;
+	if(node->prev)
 		node->prev->next = newnode;
 	else
 		avltree->head = newnode;
 	node->prev = newnode;
+#	endif
+
+	node->left = newnode;
+	avl_hash_add(avltree, newnode);
+	avl_rebalance_insert(avltree, node, newnode);
+	avl_hook_inserted(avltree, newnode);
+	return newnode;
+}
+
+avl_node_t *avl_insert_after(avl_tree_t *avltree, avl_node_t *node, avl_node_t *newnode) {
+	if(!avltree || !newnode)
+		return NULL;
+
+	if(avl_hash_reserve(avltree, 1))
+		return NULL;
+
+	if(!node)
+		return avltree->head
+			? avl_insert_before(avltree, avltree->head, newnode)
+			: avl_insert_top(avltree, newnode);
+
+	if(node->right)
+		return avl_insert_before(avltree, NODE_NEXT(node), newnode);
+
+	avl_node_clear(avltree, newnode);
+
+	newnode->parent = node;
+
+#	ifdef AVL_NO_LIST
+	if(node == avltree->tail)
+		avltree->tail = newnode;
+#	else
+	newnode->prev = node;
+	newnode->next = node->next;
+	if(node->next)
+		node->next->prev = newnode;
+	else
+		avltree->tail = newnode;
+	node->next = newnode;
+#	endif
+
+	node->right = newnode;
+	avl_hash_add(avltree, newnode);
+	avl_rebalance_insert(avltree, node, newnode);
+	avl_hook_inserted(avltree, newnode);
+	return newnode;
+}
+
+/* Inserts newnode where its item belongs, rebalancing along the path
+ * that was taken to get there. If unique is set, fails with EEXIST if
+ * an equal item is found; if not, the node is put after those.
+ * O(lg n) */
+static avl_node_t *avl_insert_path(avl_tree_t *avltree, avl_node_t *newnode, int unique) {
+	avl_node_t **path[AVL_MAX_HEIGHT];
+	avl_node_t **link, *node, *parent, *prev, *next;
+	avl_cmp_t cmp;
+	void *userdata;
+	int c, n, i;
+
+	cmp = avltree->cmp;
+	userdata = avltree->userdata;
+
+	/* Descend, remembering the path and the neighbours of the new node
+	 * so that neither parent pointers nor the list have to be consulted
+	 * afterwards. */
+	parent = prev = next = NULL;
+	link = &avltree->top;
+	n = 0;
+	while((node = *link)) {
+		c = cmp(newnode->item, node->item, userdata);
+		if(!c && unique)
+			return errno = EEXIST, (avl_node_t *)NULL;
+		path[n++] = link;
+		parent = node;
+		if(c < 0) {
+			next = node;
+			link = &node->left;
+		} else {
+			prev = node;
+			link = &node->right;
+		}
+	}
+
+	if(avl_hash_reserve(avltree, 1))
+		return NULL;
+
+	avl_node_clear(avltree, newnode);
+	newnode->parent = parent;
+	*link = newnode;
+	avl_hash_add(avltree, newnode);
+
+#	ifndef AVL_NO_LIST
+	newnode->prev = prev;
+	newnode->next = next;
+	if(prev)
+		prev->next = newnode;
+	if(next)
+		next->prev = newnode;
+#	endif
+	if(!prev)
+		avltree->head = newnode;
+	if(!next)
+		avltree->tail = newnode;
+
+#	ifdef AVL_COUNT
+	for(i = 0; i < n; i++)
+		(*path[i])->count += NODE_MULT(newnode);
+#	else
+	(void)i;
+#	endif
+#	ifdef AVL_MERKLE
+	for(i = 0; i < n; i++)
+		(*path[i])->digest += newnode->digest;
+#	endif
+
+	avl_rebalance_path(path, n);
+	avl_hook_inserted(avltree, newnode);
+
+	return newnode;
+}
+
+avl_node_t *avl_insert(avl_tree_t *avltree, avl_node_t *newnode) {
+	if(!avltree || !newnode)
+		return NULL;
+
+	return avl_insert_path(avltree, newnode, 1);
+}
+
+avl_node_t *avl_insert_left(avl_tree_t *avltree, avl_node_t *newnode) {
+	return avl_insert_before(avltree, avl_search_left(avltree, newnode->item, NULL), newnode);
+}
+
+avl_node_t *avl_insert_right(avl_tree_t *avltree, avl_node_t *newnode) {
+	if(!avltree || !newnode)
+		return NULL;
+
+	return avl_insert_path(avltree, newnode, 0);
+}
+
+avl_node_t *avl_insert_somewhere(avl_tree_t *avltree, avl_node_t *newnode) {
+	return avl_insert_right(avltree, newnode);
+}
+
+avl_node_t *avl_item_insert(avl_tree_t *avltree, const void *item) {
+	avl_node_t *newnode;
+
+	if(!avltree)
+		return errno = EFAULT, (avl_node_t *)NULL;
+
+	newnode = avl_alloc(avltree, item);
+	if(newnode) {
+		if(avl_insert(avltree, newnode))
+			return newnode;
+		avl_node_free(avltree, newnode);
+	}
+	return NULL;
+}
+
+avl_node_t *avl_item_insert_somewhere(avl_tree_t *avltree, const void *item) {
+	avl_node_t *newnode;
+
+	if(!avltree)
+		return errno = EFAULT, (avl_node_t *)NULL;
+
+	newnode = avl_alloc(avltree, item);
+	if(newnode)
+		return avl_insert_somewhere(avltree, newnode);
+	return NULL;
+}
+
+avl_node_t *avl_item_insert_before(avl_tree_t *avltree, avl_node_t *node, const void *item) {
+	avl_node_t *newnode;
+
+	if(!avltree)
+		return errno = EFAULT, (avl_node_t *)NULL;
+
+	newnode = avl_alloc(avltree, item);
+	if(newnode)
+		return avl_insert_before(avltree, node, newnode);
+	return NULL;
+}
+
+avl_node_t *avl_item_insert_after(avl_tree_t *avltree, avl_node_t *node, const void *item) {
+	avl_node_t *newnode;
+
+	if(!avltree)
+		return errno = EFAULT, (avl_node_t *)NULL;
+
+	newnode = avl_alloc(avltree, item);
+	if(newnode)
+		return avl_insert_after(avltree, node, newnode);
+	return NULL;
+}
+
+avl_node_t *avl_item_insert_left(avl_tree_t *avltree, const void *item) {
+	avl_node_t *newnode;
+
+	if(!avltree)
+		return errno = EFAULT, (avl_node_t *)NULL;
+
+	newnode = avl_alloc(avltree, item);
+	if(newnode)
+		return avl_insert_left(avltree, newnode);
+	return NULL;
+}
+
+avl_node_t *avl_item_insert_right(avl_tree_t *avltree, const void *item) {
+	avl_node_t *newnode;
+
+	if(!avltree)
+		return errno = EFAULT, (avl_node_t *)NULL;
+
+	newnode = avl_alloc(avltree, item);
+	if(newnode)
+		return avl_insert_right(avltree, newnode);
+	return NULL;
+}
+
+/* Builds a perfectly balanced subtree out of the first n nodes of the
+ * list at *list (linked through their ->right pointers) and advances
+ * *list past them. The nodes are linked to each other in order as they
+ * are taken off the list, after *prev, which is left pointing at the
+ * last one. The parent of the returned node is not set.
+ * O(n) */
+static avl_node_t *avl_build(avl_node_t **list, unsigned long n, avl_node_t **prev) {
+	avl_node_t *avlnode, *left;
+
+	if(!n)
+		return NULL;
+
+	left = avl_build(list, (n - 1) / 2, prev);
+	avlnode = *list;
+	*list = avlnode->right;
+
+#	ifndef AVL_NO_LIST
+	avlnode->prev = *prev;
+	if(*prev)
+		(*prev)->next = avlnode;
+#	endif
+	*prev = avlnode;
+
+	avlnode->left = left;
+	if(left)
+		left->parent = avlnode;
+	avlnode->right = avl_build(list, n / 2, prev);
+	if(avlnode->right)
+		avlnode->right->parent = avlnode;
+
+#	ifdef AVL_COUNT
+	avlnode->count = CALC_COUNT(avlnode);
+#	endif
+#	ifdef AVL_DEPTH
+	avlnode->depth = CALC_DEPTH(avlnode);
+#	endif
+#	ifdef AVL_MERKLE
+	avlnode->digest = CALC_DIGEST(avlnode);
+#	endif
+
+	return avlnode;
+}
+
+/* Replaces the structure of the tree with a perfectly balanced tree
+ * made out of the n nodes in list (linked through their ->right
+ * pointers, in order).
+ * O(n) */
+static void avl_rebuild(avl_tree_t *avltree, avl_node_t *list, unsigned long n) {
+	avl_node_t *prev = NULL;
+
+	avltree->head = list;
+	avltree->top = avl_build(&list, n, &prev);
+	if(avltree->top)
+		avltree->top->parent = NULL;
+#	ifndef AVL_NO_LIST
+	if(prev)
+		prev->next = NULL;
+#	endif
+	avltree->tail = prev;
+}
+
+/* Merges two sorted lists linked through ->right. Of equal items, those
+ * of a go first.
+ * O(n) */
+static avl_node_t *avl_merge(avl_node_t *a, avl_node_t *b, avl_cmp_t cmp, void *userdata) {
+	avl_node_t *list, **tail = &list;
+
+	while(a && b) {
+		if(cmp(b->item, a->item, userdata) < 0) {
+			*tail = b;
+			tail = &b->right;
+			b = b->right;
+		} else {
+			*tail = a;
+			tail = &a->right;
+			a = a->right;
+		}
+	}
+	*tail = a ? a : b;
+
+	return list;
+}
+
+/* Sorts a list linked through ->right, keeping equal items in their
+ * original order. Bottom-up: bins[i] holds a sorted run of 2^i nodes.
+ * O(n lg n) */
+static avl_node_t *avl_sort(avl_node_t *list, avl_cmp_t cmp, void *userdata) {
+	avl_node_t *bins[sizeof(unsigned long) * 8], *node;
+	int i, used = 0;
+
+	while(list) {
+		node = list;
+		list = list->right;
+		node->right = NULL;
+		for(i = 0; i < used && bins[i]; i++) {
+			node = avl_merge(bins[i], node, cmp, userdata);
+			bins[i] = NULL;
+		}
+		if(i == used)
+			used++;
+		bins[i] = node;
+	}
+
+	node = NULL;
+	for(i = 0; i < used; i++)
+		if(bins[i])
+			node = avl_merge(bins[i], node, cmp, userdata);
+
+	return node;
+}
+
+/* What avl_tree_resort() sorts when it can: the items are right there,
+ * instead of one pointer away. */
+typedef struct avl_sort_entry {
+	void *item;
+	avl_node_t *node;
+} avl_sort_entry_t;
+
+/* Sorts n entries, keeping equal items in their original order. Runs of
+ * AVL_SORT_RUN are insertion sorted, then merged back and forth between
+ * a and tmp. Returns whichever of the two holds the result.
+ * O(n lg n) */
+static avl_sort_entry_t *avl_sort_array(avl_sort_entry_t *a, avl_sort_entry_t *tmp, unsigned long n, avl_cmp_t cmp, void *userdata) {
+	avl_sort_entry_t *src = a, *dst = tmp, *swap, e;
+	unsigned long i, j, k, lo, mid, hi, width;
+
+	for(lo = 0; lo < n; lo += AVL_SORT_RUN) {
+		hi = lo + AVL_SORT_RUN < n ? lo + AVL_SORT_RUN : n;
+		for(i = lo + 1; i < hi; i++) {
+			e = a[i];
+			for(j = i; j > lo && cmp(e.item, a[j - 1].item, userdata) < 0; j--)
+				a[j] = a[j - 1];
+			a[j] = e;
+		}
+	}
+
+	for(width = AVL_SORT_RUN; width < n; width *= 2) {
+		for(lo = 0; lo < n; lo += 2 * width) {
+			mid = lo + width < n ? lo + width : n;
+			hi = mid + width < n ? mid + width : n;
+			i = k = lo;
+			j = mid;
+			while(i < mid && j < hi)
+				dst[k++] = cmp(src[j].item, src[i].item, userdata) < 0
+					? src[j++] : src[i++];
+			while(i < mid)
+				dst[k++] = src[i++];
+			while(j < hi)
+				dst[k++] = src[j++];
+		}
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	return src;
+}
+
+#ifdef AVL_MULTISET
+/* Adds the copies of dup to node and frees dup. If next is not NULL, it
+ * points to dup and is made to point past it.
+ * O(1) */
+static void avl_sort_collapse(avl_tree_t *avltree, avl_node_t *avlnode, avl_node_t *dup, avl_node_t **next) {
+	avlnode->multiplicity += dup->multiplicity;
+	if(next)
+		*next = dup->right;
+	avl_hash_remove(avltree, dup);
+	if(avltree->free)
+		avltree->free(dup->item, avltree->userdata);
+	avl_node_free(avltree, dup);
+}
+#endif
+
+/* Builds a perfectly balanced subtree out of the nodes of entries lo up
+ * to hi, like avl_build() does, and links them to their neighbours in
+ * the array (of n entries) as it goes, so that each node is visited
+ * once.
+ * O(n) */
+static avl_node_t *avl_build_sorted(const avl_sort_entry_t *entries, unsigned long lo, unsigned long hi, unsigned long n) {
+	avl_node_t *avlnode;
+	unsigned long mid;
+
+	if(lo == hi)
+		return NULL;
+
+	mid = lo + (hi - lo - 1) / 2;
+	avlnode = entries[mid].node;
+
+#	ifndef AVL_NO_LIST
+	avlnode->prev = mid ? entries[mid - 1].node : NULL;
+	avlnode->next = mid + 1 < n ? entries[mid + 1].node : NULL;
+#	endif
+
+	avlnode->left = avl_build_sorted(entries, lo, mid, n);
+	if(avlnode->left)
+		avlnode->left->parent = avlnode;
+	avlnode->right = avl_build_sorted(entries, mid + 1, hi, n);
+	if(avlnode->right)
+		avlnode->right->parent = avlnode;
+
+#	ifdef AVL_COUNT
+	avlnode->count = CALC_COUNT(avlnode);
+#	endif
+#	ifdef AVL_DEPTH
+	avlnode->depth = CALC_DEPTH(avlnode);
+#	endif
+#	ifdef AVL_MERKLE
+	avlnode->digest = CALC_DIGEST(avlnode);
+#	endif
+
+	return avlnode;
+}
+
+int avl_tree_resort(avl_tree_t *avltree, avl_cmp_t cmp, void *userdata) {
+	avl_sort_entry_t *entries = NULL, *e;
+	avl_node_t *list, *node;
+	unsigned long n = 0, cap = 0;
+	int sorted = 1;
+#	ifdef AVL_MULTISET
+	unsigned long i, j;
+#	endif
+
+	if(!avltree || !cmp)
+		return errno = EFAULT, -1;
+	if(avltree->hooks)
+		return errno = EINVAL, -1;
+
+	avltree->cmp = cmp;
+	avltree->userdata = userdata;
+
+	/* Collect the nodes and their items in one pass, noting whether
+	 * they happen to be in order already. */
+	for(node = avltree->head; node; node = NODE_NEXT(node)) {
+		if(n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			e = realloc(entries, 2 * cap * sizeof *entries);
+			if(!e) {
+				free(entries);
+				entries = NULL;
+				break;
+			}
+			entries = e;
+		}
+#		ifdef AVL_MULTISET
+		if(n && cmp(entries[n - 1].item, node->item, userdata) >= 0)
+#		else
+		if(n && cmp(entries[n - 1].item, node->item, userdata) > 0)
+#		endif
+			sorted = 0;
+		entries[n].item = node->item;
+		entries[n].node = node;
+		n++;
+	}
+
+	if(!entries) {
+		/* No memory for the array: sort the list instead, which is
+		 * several times slower as every step is a cache miss. */
+		*avl_flatten(avltree->top, &list) = NULL;
+		list = avl_sort(list, cmp, userdata);
+		for(n = 0, node = list; node; node = node->right, n++) {
+#			ifdef AVL_MULTISET
+			while(node->right && !cmp(node->item, node->right->item, userdata))
+				avl_sort_collapse(avltree, node, node->right, &node->right);
+#			endif
+		}
+		avl_rebuild(avltree, list, n);
+		return 0;
+	}
+
+	if(sorted) {
+		free(entries);
+		return 0;
+	}
+
+	e = avl_sort_array(entries, entries + cap, n, cmp, userdata);
+
+#	ifdef AVL_MULTISET
+	/* Items that have become equal collapse into one node. */
+	for(i = 0, j = 1; j < n; j++) {
+		if(cmp(e[i].item, e[j].item, userdata))
+			e[++i] = e[j];
+		else
+			avl_sort_collapse(avltree, e[i].node, e[j].node, NULL);
+	}
+	if(n)
+		n = i + 1;
+#	endif
+
+	avltree->top = avl_build_sorted(e, 0, n, n);
+	if(avltree->top)
+		avltree->top->parent = NULL;
+	avltree->head = n ? e[0].node : NULL;
+	avltree->tail = n ? e[n - 1].node : NULL;
+
+	free(entries);
+
+	return 0;
+}
+
+/* Copies the subtree under node for dst, with the copy hanging from
+ * parent. The copies are linked in order after *prev, which is left
+ * pointing at the last one. On failure, the copies made are freed.
+ * O(n) */
+static avl_node_t *avl_clone_subtree(avl_tree_t *dst, const avl_node_t *avlnode, avl_node_t *parent, avl_node_t **prev) {
+	avl_node_t *copy, *left;
+
+	if(!avlnode)
+		return NULL;
+
+	left = avl_clone_subtree(dst, avlnode->left, NULL, prev);
+	if(avlnode->left && !left)
+		return NULL;
+
+	copy = avl_alloc(dst, avlnode->item);
+	if(!copy) {
+		avl_clone_free(dst, left);
+		return NULL;
+	}
+	*copy = *avlnode;
+	copy->parent = parent;
+	copy->left = left;
+	if(left)
+		left->parent = copy;
+#	ifndef AVL_NO_LIST
+	copy->prev = *prev;
+	copy->next = NULL;
+	if(*prev)
+		(*prev)->next = copy;
+#	endif
+	*prev = copy;
+
+	copy->right = avl_clone_subtree(dst, avlnode->right, copy, prev);
+	if(avlnode->right && !copy->right) {
+		copy->right = NULL;
+		avl_clone_free(dst, copy);
+		return NULL;
+	}
+
+	return copy;
+}
+
+/* Frees a subtree of copies, leaving the items alone.
+ * O(n) */
+static void avl_clone_free(avl_tree_t *dst, avl_node_t *avlnode) {
+	avl_node_t *right;
+
+	while(avlnode) {
+		avl_clone_free(dst, avlnode->left);
+		right = avlnode->right;
+		avl_node_free(dst, avlnode);
+		avlnode = right;
+	}
+}
+
+/* Takes over the shape of src once the nodes have been copied. */
+static int avl_clone_finish(const avl_tree_t *src, avl_tree_t *dst, avl_node_t *top, avl_node_t *tail) {
+	avl_node_t *head = top, *node;
+
+	while(head && head->left)
+		head = head->left;
+
+	dst->top = top;
+	dst->head = head;
+	dst->tail = tail;
+	dst->cmp = src->cmp;
+	dst->userdata = src->userdata;
+#	ifdef AVL_MERKLE
+	dst->merkle = src->merkle;
+#	endif
+
+	/* Reindex with the hash function the index of dst already had. */
+	if(dst->hash && avl_tree_hash_index(dst, dst->hash->hash)) {
+		avl_clone_free(dst, top);
+		(void)avl_tree_empty(dst);
+		return -1;
+	}
+
+	if(dst->hooks)
+		for(node = head; node; node = NODE_NEXT(node))
+			avl_hook_inserted(dst, node);
+
+	return 0;
+}
+
+int avl_tree_clone(const avl_tree_t *src, avl_tree_t *dst) {
+	avl_node_t *top, *prev = NULL;
+
+	if(!src || !dst)
+		return errno = EFAULT, -1;
+	if(dst->top || src == dst)
+		return errno = EINVAL, -1;
+
+	top = avl_clone_subtree(dst, src->top, NULL, &prev);
+	if(src->top && !top)
+		return -1;
+
+	return avl_clone_finish(src, dst, top, prev);
+}
+
+#if AVL_HAVE_POSIX
+/* A piece of the tree that avl_tree_clone_parallel() copies: either a
+ * subtree that a thread copies in one go, or a single node near the
+ * top that is copied up front. */
+typedef struct avl_clone_piece {
+	const avl_node_t *node;
+	avl_node_t *parent;
+	avl_node_t **slot;
+	avl_node_t *first;
+	avl_node_t *last;
+	int whole;
+} avl_clone_piece_t;
+
+typedef struct avl_clone_job {
+	avl_tree_t *dst;
+	avl_clone_piece_t *pieces;
+	unsigned long npieces;
+	unsigned long next;
+	pthread_mutex_t lock;
+	int failed;
+} avl_clone_job_t;
+
+/* Whether a subtree is small enough to be copied by one thread: by
+ * count, or by depth without counts. */
+#ifdef AVL_COUNT
+#define AVL_CLONE_WHOLE(n, target) (NODE_COUNT(n) <= (target))
+#else
+#define AVL_CLONE_WHOLE(n, target) (NODE_DEPTH(n) <= (target))
+#endif
+
+/* Counts the pieces that avl_clone_plan() will cut the tree into.
+ * O(pieces) */
+static unsigned long avl_clone_pieces(const avl_node_t *avlnode, unsigned long target) {
+	if(!avlnode)
+		return 0;
+	if(AVL_CLONE_WHOLE(avlnode, target))
+		return 1;
+	return avl_clone_pieces(avlnode->left, target) + 1
+		+ avl_clone_pieces(avlnode->right, target);
+}
+
+/* Cuts the tree into pieces, in order: subtrees that are small enough
+ * to be copied by one thread, and the nodes above them. Those nodes are
+ * copied right away.
+ * O(pieces) */
+static int avl_clone_plan(avl_tree_t *dst, const avl_node_t *avlnode, avl_node_t *parent, avl_node_t **slot, unsigned long target, avl_clone_piece_t *pieces, unsigned long *n) {
+	avl_clone_piece_t *piece;
+	avl_node_t *copy;
+
+	*slot = NULL;
+	if(!avlnode)
+		return 0;
+
+	if(AVL_CLONE_WHOLE(avlnode, target)) {
+		piece = pieces + (*n)++;
+		piece->node = avlnode;
+		piece->parent = parent;
+		piece->slot = slot;
+		piece->whole = 1;
+		return 0;
+	}
+
+	copy = avl_alloc(dst, avlnode->item);
+	if(!copy)
+		return -1;
+	*copy = *avlnode;
+	copy->parent = parent;
+	copy->left = copy->right = NULL;
+	*slot = copy;
+
+	if(avl_clone_plan(dst, avlnode->left, copy, &copy->left, target, pieces, n))
+		return -1;
+	piece = pieces + (*n)++;
+	piece->node = avlnode;
+	piece->first = piece->last = copy;
+	piece->whole = 0;
+	return avl_clone_plan(dst, avlnode->right, copy, &copy->right, target, pieces, n);
+}
+
+/* Copies the subtrees that no other thread has taken yet. */
+static void *avl_clone_worker(void *arg) {
+	avl_clone_job_t *job = arg;
+	avl_clone_piece_t *piece;
+	avl_node_t *first;
+	unsigned long i;
+
+	for(;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if(i >= job->npieces)
+			break;
+
+		piece = job->pieces + i;
+		if(!piece->whole)
+			continue;
+		piece->last = NULL;
+		*piece->slot = avl_clone_subtree(job->dst, piece->node, piece->parent, &piece->last);
+		if(!*piece->slot) {
+			pthread_mutex_lock(&job->lock);
+			job->failed = 1;
+			pthread_mutex_unlock(&job->lock);
+			continue;
+		}
+		for(first = *piece->slot; first->left; first = first->left)
+			;
+		piece->first = first;
+	}
+
+	return NULL;
+}
+
+int avl_tree_clone_parallel(const avl_tree_t *src, avl_tree_t *dst, unsigned int threads) {
+	avl_clone_job_t job;
+	pthread_t *tids;
+	avl_node_t *top = NULL, *prev = NULL;
+	unsigned long target, i;
+	unsigned int t, started;
+	int err;
+
+	if(!src || !dst)
+		return errno = EFAULT, -1;
+	if(dst->top || src == dst)
+		return errno = EINVAL, -1;
+
+	if(threads < 2 || !src->top)
+		return avl_tree_clone(src, dst);
+
+	/* About four subtrees per thread, to even out their sizes. */
+#	ifdef AVL_COUNT
+	target = NODE_COUNT(src->top) / (4UL * threads) + 1;
+#	else
+	target = NODE_DEPTH(src->top);
+	for(i = 4UL * threads; i > 1 && target > 1; i /= 2)
+		target--;
+#	endif
+
+	job.dst = dst;
+	job.npieces = avl_clone_pieces(src->top, target);
+	job.next = 0;
+	job.failed = 0;
+	job.pieces = malloc(job.npieces * sizeof *job.pieces);
+	tids = malloc(threads * sizeof *tids);
+	err = pthread_mutex_init(&job.lock, NULL);
+	if(!job.pieces || !tids || err) {
+		free(job.pieces);
+		free(tids);
+		if(err)
+			errno = err;
+		else
+			pthread_mutex_destroy(&job.lock);
+		return -1;
+	}
+
+	job.npieces = 0;
+	if(avl_clone_plan(dst, src->top, NULL, &top, target, job.pieces, &job.npieces)) {
+		/* Leave the pieces planned so far alone. */
+		job.failed = 1;
+		job.npieces = 0;
+	}
+
+	/* If threads can't be started, the others do their work. */
+	for(started = 1; started < threads; started++)
+		if(pthread_create(tids + started, NULL, avl_clone_worker, &job))
+			break;
+	avl_clone_worker(&job);
+	for(t = 1; t < started; t++)
+		pthread_join(tids[t], NULL);
+
+	pthread_mutex_destroy(&job.lock);
+	free(tids);
+
+	if(job.failed) {
+		/* Subtrees that failed have been freed already and are
+		 * NULL in their parents. */
+		free(job.pieces);
+		avl_clone_free(dst, top);
+		return errno = ENOMEM, -1;
+	}
+
+	/* Stitch the pieces together. */
+	for(i = 0; i < job.npieces; i++) {
+#		ifndef AVL_NO_LIST
+		job.pieces[i].first->prev = prev;
+		if(prev)
+			prev->next = job.pieces[i].first;
+#		endif
+		prev = job.pieces[i].last;
+	}
+	free(job.pieces);
 
-	node->left = newnode;
-	avl_rebalance(avltree, node);
-	return newnode;
+	return avl_clone_finish(src, dst, top, prev);
 }
+#endif
 
-avl_node_t *avl_insert_after(avl_tree_t *avltree, avl_node_t *node, avl_node_t *newnode) {
-	if(!avltree || !newnode)
-		return NULL;
+long avl_tree_retain(avl_tree_t *avltree, avl_pred_t pred, void *userdata) {
+	avl_node_t *list, *kept, **tail, *node, *next;
+	avl_free_t func;
+	unsigned long n = 0;
+	long removed = 0;
 
-	if(!node)
-		return avltree->head
-			? avl_insert_before(avltree, avltree->head, newnode)
-			: avl_insert_top(avltree, newnode);
+	if(!avltree || !pred)
+		return errno = EFAULT, -1L;
 
-	if(node->right)
-		return avl_insert_before(avltree, node->next, newnode);
+	func = avltree->free;
 
-	avl_node_clear(newnode);
+#	ifdef AVL_NO_LIST
+	*avl_flatten(avltree->top, &list) = NULL;
+#	else
+	/* The list still holds them together while ->right is reused. */
+	list = avltree->head;
+#	endif
 
-	newnode->prev = node;
-	newnode->parent = node;
+	tail = &kept;
+	for(node = list; node; node = next) {
+#		ifdef AVL_NO_LIST
+		next = node->right;
+#		else
+		next = node->next;
+#		endif
+		if(pred(node->item, userdata)) {
+			*tail = node;
+			tail = &node->right;
+			n++;
+		} else {
+			avl_hash_remove(avltree, node);
+			avl_hook_unlinked(avltree, node);
+			avl_hook_deleted(avltree, node);
+			if(func)
+				func(node->item, avltree->userdata);
+			avl_node_free(avltree, node);
+			removed++;
+		}
+	}
+	*tail = NULL;
 
-	newnode->next = node->next;
-	if(node->next)
-		node->next->prev = newnode;
-	else
-		avltree->tail = newnode;
-	node->next = newnode;
+	avl_rebuild(avltree, kept, n);
 
-	node->right = newnode;
-	avl_rebalance(avltree, node);
-	return newnode;
+	return removed;
 }
 
-avl_node_t *avl_insert(avl_tree_t *avltree, avl_node_t *newnode) {
-	avl_node_t *node;
+/* Finds the insertion point for item like avl_search_rightish() does,
+ * but starts at finger instead of at the top. The item must not be
+ * smaller than the item of finger. Climbs only as far as needed to find
+ * a subtree that can contain the item, so the cost is logarithmic in
+ * the distance between finger and the insertion point.
+ * O(lg d) */
+static avl_node_t *avl_search_finger(const avl_tree_t *avltree, avl_node_t *finger, const void *item, int *exact) {
+	avl_cmp_t cmp = avltree->cmp;
+	void *userdata = avltree->userdata;
+	avl_node_t *node, *parent;
+
+	if(!finger)
+		return avl_descend_rightish(avltree, avltree->top, item, exact);
+
+	for(node = finger; (parent = node->parent); node = parent)
+		if(node == parent->left && cmp(item, parent->item, userdata) < 0)
+			break;
+
+	return avl_descend_rightish(avltree, node, item, exact);
+}
+
+long avl_tree_insert_sorted_batch(avl_tree_t *avltree, void *const *items, unsigned long k) {
+	avl_node_t *batch, **tail, *node, *next, *finger;
+	avl_cmp_t cmp;
+	void *userdata;
+	unsigned long i;
+	long inserted = 0;
 	int c;
+#	ifdef AVL_COUNT
+	avl_node_t *list, *merged;
+	unsigned long n;
+#	endif
+
+	if(!avltree)
+		return errno = EFAULT, -1L;
+
+	cmp = avltree->cmp;
+	userdata = avltree->userdata;
+
+	if(avl_hash_reserve(avltree, k))
+		return -1L;
+
+	/* Allocate all nodes first so that failure leaves the tree alone.
+	 * Duplicates within the batch are dropped right away. */
+	batch = NULL;
+	tail = &batch;
+	for(i = 0; i < k; i++) {
+		if(i && !cmp(items[i], items[i - 1], userdata))
+			continue;
+		node = avl_alloc(avltree, items[i]);
+		if(!node) {
+			for(node = batch; node; node = next) {
+				next = node->right;
+				avl_node_free(avltree, node);
+			}
+			return -1L;
+		}
+		*tail = node;
+		tail = &node->right;
+	}
+	*tail = NULL;
+
+#	ifdef AVL_COUNT
+	n = NODE_COUNT(avltree->top);
+	if(k > n / AVL_BATCH_MERGE_RATIO) {
+		/* Large batch: merge with the existing nodes and rebuild. */
+		*avl_flatten(avltree->top, &list) = NULL;
+#		ifdef AVL_MULTISET
+		/* n counted copies, the rebuild needs nodes. */
+		for(n = 0, node = list; node; node = node->right)
+			n++;
+#		endif
+		tail = &merged;
+		while(list && batch) {
+			c = cmp(batch->item, list->item, userdata);
+			if(c < 0) {
+				avl_hash_add(avltree, batch);
+				avl_merkle_set(avltree, batch);
+				avl_hook_inserted(avltree, batch);
+				*tail = batch;
+				tail = &batch->right;
+				batch = batch->right;
+				inserted++;
+			} else {
+				if(!c) {
+					next = batch->right;
+					avl_node_free(avltree, batch);
+					batch = next;
+				}
+				*tail = list;
+				tail = &list->right;
+				list = list->right;
+			}
+		}
+		for(*tail = list ? list : batch; batch; batch = batch->right) {
+			avl_hash_add(avltree, batch);
+			avl_merkle_set(avltree, batch);
+			avl_hook_inserted(avltree, batch);
+			inserted++;
+		}
+		avl_rebuild(avltree, merged, n + inserted);
+		return inserted;
+	}
+#	endif
+
+	/* Small batch: insert one by one, each search starting from the
+	 * node that was inserted previously. When balancing on depth, the
+	 * rebalancing after each insert stops early too. */
+	finger = NULL;
+	for(node = batch; node; node = next) {
+		next = node->right;
+		finger = avl_search_finger(avltree, finger, node->item, &c);
+		if(c) {
+			avl_node_free(avltree, node);
+		} else {
+			finger = avl_insert_after(avltree, finger, node);
+			inserted++;
+		}
+	}
 
-	node = avl_search_rightish(avltree, newnode->item, &c);
-	return c ? NULL : avl_insert_after(avltree, node, newnode);
+	return inserted;
 }
 
-avl_node_t *avl_insert_left(avl_tree_t *avltree, avl_node_t *newnode) {
-	return avl_insert_before(avltree, avl_search_left(avltree, newnode->item, NULL), newnode);
+avl_node_t *avl_unlink(avl_tree_t *avltree, avl_node_t *avlnode) {
+	avl_node_t *parent;
+	avl_node_t **superparent;
+	avl_node_t *subst, *left, *right;
+	avl_node_t *balnode;
+
+	if(!avltree || !avlnode)
+		return NULL;
+
+	avl_hash_remove(avltree, avlnode);
+	avl_hook_unlinked(avltree, avlnode);
+
+#	ifdef AVL_NO_LIST
+	if(avlnode == avltree->head)
+		avltree->head = avl_next(avlnode);
+	if(avlnode == avltree->tail)
+		avltree->tail = avl_prev(avlnode);
+#	else
+	if(avlnode->prev)
+		avlnode->prev->next = avlnode->next;
+	else
+		avltree->head = avlnode->next;
+
+	if(avlnode->next)
+		avlnode->next->prev = avlnode->prev;
+	else
+		avltree->tail = avlnode->prev;
+#	endif
+
+	parent = avlnode->parent;
+
+	superparent = parent
+		? avlnode == parent->left ? &parent->left : &parent->right
+		: &avltree->top;
+
+	left = avlnode->left;
+	right = avlnode->right;
+	if(!left) {
+		*superparent = right;
+		if(right)
+			right->parent = parent;
+		balnode = parent;
+	} else if(!right) {
+		*superparent = left;
+		left->parent = parent;
+		balnode = parent;
+	} else {
+		subst = NODE_PREV(avlnode);
+		if(subst == left) {
+			balnode = subst;
+		} else {
+			balnode = subst->parent;
+			balnode->right = subst->left;
+			if(balnode->right)
+				balnode->right->parent = balnode;
+			subst->left = left;
+			left->parent = subst;
+		}
+		subst->right = right;
+		subst->parent = parent;
+		right->parent = subst;
+		*superparent = subst;
+	}
+
+	avl_rebalance(avltree, balnode);
+
+	return avlnode;
 }
 
-avl_node_t *avl_insert_right(avl_tree_t *avltree, avl_node_t *newnode) {
-	return avl_insert_after(avltree, avl_search_right(avltree, newnode->item, NULL), newnode);
+void *avl_delete(avl_tree_t *avltree, avl_node_t *avlnode) {
+	void *item = NULL;
+	if(avlnode) {
+		item = avlnode->item;
+		(void)avl_unlink(avltree, avlnode);
+		avl_hook_deleted(avltree, avlnode);
+		if(avltree->free)
+			avltree->free(item, avltree->userdata);
+		avl_node_free(avltree, avlnode);
+	}
+	return item;
 }
 
-avl_node_t *avl_insert_somewhere(avl_tree_t *avltree, avl_node_t *newnode) {
-	return avl_insert_after(avltree, avl_search_rightish(avltree, newnode->item, NULL), newnode);
+/* Unlinks the head of the tree (or the tail, if last is set). That node
+ * has no child on the outside, so nothing needs to take its place, and
+ * every node above it is on the outer spine, which saves working out
+ * which side of its parent each of them is on while rebalancing.
+ * O(lg n) */
+static avl_node_t *avl_unlink_end(avl_tree_t *avltree, int last) {
+	avl_node_t *avlnode, *parent, *child, *next, *node;
+
+	avlnode = last ? avltree->tail : avltree->head;
+	parent = avlnode->parent;
+	child = last ? avlnode->left : avlnode->right;
+	next = last ? NODE_PREV(avlnode) : NODE_NEXT(avlnode);
+
+	avl_hash_remove(avltree, avlnode);
+	avl_hook_unlinked(avltree, avlnode);
+
+	if(!parent)
+		avltree->top = child;
+	else if(last)
+		parent->right = child;
+	else
+		parent->left = child;
+	if(child)
+		child->parent = parent;
+
+	if(last) {
+		avltree->tail = next;
+#		ifndef AVL_NO_LIST
+		if(next)
+			next->next = NULL;
+#		endif
+	} else {
+		avltree->head = next;
+#		ifndef AVL_NO_LIST
+		if(next)
+			next->prev = NULL;
+#		endif
+	}
+	if(!next)
+		avltree->head = avltree->tail = NULL;
+
+	for(node = parent; node; node = parent) {
+		parent = node->parent;
+		avl_balance_node(parent
+			? last ? &parent->right : &parent->left
+			: &avltree->top, node);
+	}
+
+	return avlnode;
 }
 
-avl_node_t *avl_item_insert(avl_tree_t *avltree, const void *item) {
-	avl_node_t *newnode;
+static void *avl_pop(avl_tree_t *avltree, int last) {
+	avl_node_t *avlnode;
+	void *item;
+
+	if(!avltree || !avltree->top)
+		return NULL;
+
+	avlnode = avl_unlink_end(avltree, last);
+	item = avlnode->item;
+	avl_node_free(avltree, avlnode);
+	return item;
+}
+
+void *avl_pop_min(avl_tree_t *avltree) {
+	return avl_pop(avltree, 0);
+}
+
+void *avl_pop_max(avl_tree_t *avltree) {
+	return avl_pop(avltree, 1);
+}
+
+unsigned long avl_pop_min_n(avl_tree_t *avltree, void **items, unsigned long n) {
+	unsigned long i;
+#	ifdef AVL_COUNT
+	avl_node_t *list, *node;
+	unsigned long count;
+#	endif
 
 	if(!avltree)
-		return errno = EFAULT, (avl_node_t *)NULL;
+		return 0;
 
-	newnode = avl_alloc(avltree, item);
-	if(newnode) {
-		if(avl_insert(avltree, newnode))
-			return newnode;
-		avl_node_free(avltree, newnode);
-		errno = EEXIST;
+#	ifdef AVL_COUNT
+	count = NODE_COUNT(avltree->top);
+	if(n > count / AVL_BATCH_MERGE_RATIO) {
+		/* Taking a good part of the tree: pop them off a list of all
+		 * nodes and build a new tree out of the rest. */
+		*avl_flatten(avltree->top, &list) = NULL;
+		for(i = 0; i < n && list; i++) {
+			node = list;
+			list = node->right;
+			items[i] = node->item;
+			avl_hash_remove(avltree, node);
+			avl_hook_unlinked(avltree, node);
+			avl_node_free(avltree, node);
+		}
+#		ifdef AVL_MULTISET
+		for(count = 0, node = list; node; node = node->right)
+			count++;
+#		else
+		count -= i;
+#		endif
+		avl_rebuild(avltree, list, count);
+		return i;
 	}
-	return NULL;
+#	endif
+
+	for(i = 0; i < n && avltree->top; i++)
+		items[i] = avl_pop(avltree, 0);
+
+	return i;
 }
 
-avl_node_t *avl_item_insert_somewhere(avl_tree_t *avltree, const void *item) {
-	avl_node_t *newnode;
+/* Whether subtree a is too large to be a sibling of subtree b. */
+static int avl_join_heavier(const avl_node_t *a, const avl_node_t *b) {
+#	ifdef AVL_DEPTH
+	return NODE_DEPTH(a) > NODE_DEPTH(b) + 1;
+#	else
+	return NODE_COUNT(a) + 1 > AVL_WEIGHT_DELTA * (NODE_COUNT(b) + 1);
+#	endif
+}
 
-	if(!avltree)
+/* Joins the subtrees left and right, with avlnode between them: all
+ * nodes in left sort before avlnode and all nodes in right after it.
+ * avlnode is hung from the spine of the larger subtree at the point
+ * where the smaller one fits next to it, and the spine is rebalanced
+ * from there up. Returns the top of the new subtree.
+ * O(|lg left - lg right| + 1) */
+static avl_node_t *avl_join(avl_node_t *left, avl_node_t *avlnode, avl_node_t *right) {
+	avl_node_t *top, *parent, *node;
+	int side;
+
+	if(left)
+		left->parent = NULL;
+	if(right)
+		right->parent = NULL;
+
+	top = NULL;
+	parent = NULL;
+	side = avl_join_heavier(left, right) ? 1 : avl_join_heavier(right, left) ? -1 : 0;
+	if(side > 0) {
+		top = left;
+		for(parent = NULL; avl_join_heavier(left, right); left = left->right)
+			parent = left;
+	} else if(side < 0) {
+		top = right;
+		for(parent = NULL; avl_join_heavier(right, left); right = right->left)
+			parent = right;
+	}
+
+	avlnode->left = left;
+	if(left)
+		left->parent = avlnode;
+	avlnode->right = right;
+	if(right)
+		right->parent = avlnode;
+	avlnode->parent = parent;
+	if(!parent)
+		top = avlnode;
+	else if(side > 0)
+		parent->right = avlnode;
+	else
+		parent->left = avlnode;
+
+	for(node = avlnode; node; node = parent) {
+		parent = node->parent;
+		avl_balance_node(parent
+			? side > 0 ? &parent->right : &parent->left
+			: &top, node);
+	}
+
+	return top;
+}
+
+avl_node_t *avl_unlink_upto(avl_tree_t *avltree, avl_node_t *avlnode) {
+	avl_node_t *pieces[AVL_MAX_HEIGHT];
+	avl_node_t *list, *next, *right, *node, *parent, *up, **tail;
+	int n = 0;
+
+	if(!avltree || !avlnode)
+		return NULL;
+
+	next = NODE_NEXT(avlnode);
+
+	/* Split the tree at avlnode. Everything that sorts after it is
+	 * joined together into a new tree on the way up; what sorts before
+	 * it is the left subtree of avlnode and of every node on the path
+	 * that we arrive at from the right. */
+	right = avlnode->right;
+	pieces[n++] = avlnode;
+	for(node = avlnode, parent = node->parent; parent; node = parent, parent = up) {
+		up = parent->parent;
+		if(node == parent->right)
+			pieces[n++] = parent;
+		else
+			right = avl_join(right, parent, parent->right);
+	}
+
+	avltree->top = right;
+	if(right) {
+		right->parent = NULL;
+		avltree->head = next;
+#		ifndef AVL_NO_LIST
+		next->prev = NULL;
+#		endif
+	} else {
+		avltree->head = avltree->tail = NULL;
+	}
+
+	tail = &list;
+	while(n--) {
+		node = pieces[n];
+		tail = avl_flatten(node->left, tail);
+		*tail = node;
+		tail = &node->right;
+	}
+	*tail = NULL;
+
+	for(node = list; node; node = node->right) {
+		avl_hash_remove(avltree, node);
+		avl_hook_unlinked(avltree, node);
+	}
+
+	return list;
+}
+
+#ifdef AVL_COUNT
+/* Whether nodes can't be moved to or from the tree wholesale, because
+ * the hash index or the hooks have to hear about each of them. */
+static int avl_tracked(const avl_tree_t *avltree) {
+	return avltree->hash || avltree->hooks;
+}
+
+/* Splits the tree that avlnode is in right before it. Returns the top
+ * of the subtree with avlnode and everything after it, and stores the
+ * top of the rest in *left. The list pointers are not touched.
+ * O(lg n) */
+static avl_node_t *avl_split(avl_node_t *avlnode, avl_node_t **left) {
+	avl_node_t *node, *parent, *up, *l, *r;
+
+	parent = avlnode->parent;
+	l = avlnode->left;
+	r = avl_join(NULL, avlnode, avlnode->right);
+
+	for(node = avlnode; parent; node = parent, parent = up) {
+		up = parent->parent;
+		if(parent->left == node)
+			r = avl_join(r, parent, parent->right);
+		else
+			l = avl_join(parent->left, parent, l);
+	}
+
+	if(l)
+		l->parent = NULL;
+	*left = l;
+	return r;
+}
+
+avl_node_t *avl_insert_at(avl_tree_t *avltree, unsigned long index, avl_node_t *newnode) {
+	if(!avltree || !newnode)
 		return errno = EFAULT, (avl_node_t *)NULL;
+	if(index > NODE_COUNT(avltree->top))
+		return errno = EINVAL, (avl_node_t *)NULL;
 
-	newnode = avl_alloc(avltree, item);
-	if(newnode)
-		return avl_insert_somewhere(avltree, newnode);
-	return NULL;
+	/* At the end, avl_at() returns NULL, which appends. */
+	return avl_insert_before(avltree, avl_at(avltree, index), newnode);
 }
 
-avl_node_t *avl_item_insert_before(avl_tree_t *avltree, avl_node_t *node, const void *item) {
-	avl_node_t *newnode;
+avl_node_t *avl_item_insert_at(avl_tree_t *avltree, unsigned long index, const void *item) {
+	avl_node_t *newnode, *node;
 
 	if(!avltree)
 		return errno = EFAULT, (avl_node_t *)NULL;
+	if(index > NODE_COUNT(avltree->top))
+		return errno = EINVAL, (avl_node_t *)NULL;
 
 	newnode = avl_alloc(avltree, item);
-	if(newnode)
-		return avl_insert_before(avltree, node, newnode);
-	return NULL;
+	if(!newnode)
+		return NULL;
+
+	node = avl_insert_at(avltree, index, newnode);
+	if(!node)
+		avl_node_free(avltree, newnode);
+	return node;
 }
 
-avl_node_t *avl_item_insert_after(avl_tree_t *avltree, avl_node_t *node, const void *item) {
-	avl_node_t *newnode;
+void *avl_delete_at(avl_tree_t *avltree, unsigned long index) {
+	avl_node_t *node;
 
 	if(!avltree)
-		return errno = EFAULT, (avl_node_t *)NULL;
+		return errno = EFAULT, NULL;
 
-	newnode = avl_alloc(avltree, item);
-	if(newnode)
-		return avl_insert_after(avltree, node, newnode);
-	return NULL;
+	node = avl_at(avltree, index);
+	if(!node)
+		return errno = EINVAL, NULL;
+
+	return avl_delete(avltree, node);
 }
 
-avl_node_t *avl_item_insert_left(avl_tree_t *avltree, const void *item) {
-	avl_node_t *newnode;
+int avl_tree_split(avl_tree_t *avltree, unsigned long index, avl_tree_t *rest) {
+	avl_node_t *node, *prev, *left;
+
+	if(!avltree || !rest)
+		return errno = EFAULT, -1;
+	if(rest->top || rest == avltree || avl_tracked(avltree) || avl_tracked(rest))
+		return errno = EINVAL, -1;
+
+	node = avl_at(avltree, index);
+	if(!node)
+		return 0;
+	prev = NODE_PREV(node);
+
+	rest->top = avl_split(node, &left);
+	rest->head = node;
+	rest->tail = avltree->tail;
+
+	avltree->top = left;
+	avltree->tail = prev;
+	if(!prev)
+		avltree->head = NULL;
+
+#	ifndef AVL_NO_LIST
+	node->prev = NULL;
+	if(prev)
+		prev->next = NULL;
+#	endif
+
+	return 0;
+}
+
+int avl_tree_concat(avl_tree_t *avltree, avl_tree_t *other) {
+	avl_node_t *node;
+
+	if(!avltree || !other)
+		return errno = EFAULT, -1;
+	if(other == avltree || avl_tracked(avltree) || avl_tracked(other))
+		return errno = EINVAL, -1;
+
+	if(!other->top)
+		return 0;
+
+	if(avltree->top) {
+		/* Take the first node of other to join the two on. */
+		node = avl_unlink_end(other, 0);
+#		ifndef AVL_NO_LIST
+		node->prev = avltree->tail;
+		avltree->tail->next = node;
+		node->next = other->head;
+		if(other->head)
+			other->head->prev = node;
+#		endif
+		avltree->top = avl_join(avltree->top, node, other->top);
+		avltree->tail = other->tail ? other->tail : node;
+	} else {
+		avltree->top = other->top;
+		avltree->head = other->head;
+		avltree->tail = other->tail;
+	}
 
-	if(!avltree)
-		return errno = EFAULT, (avl_node_t *)NULL;
+	other->top = other->head = other->tail = NULL;
 
-	newnode = avl_alloc(avltree, item);
-	if(newnode)
-		return avl_insert_left(avltree, newnode);
-	return NULL;
+	return 0;
 }
 
-avl_node_t *avl_item_insert_right(avl_tree_t *avltree, const void *item) {
-	avl_node_t *newnode;
+int avl_tree_slice(avl_tree_t *avltree, unsigned long from, unsigned long to, avl_tree_t *out) {
+	avl_tree_t rest;
 
-	if(!avltree)
-		return errno = EFAULT, (avl_node_t *)NULL;
+	if(!avltree || !out)
+		return errno = EFAULT, -1;
+	if(from > to || out->top || out == avltree || avl_tracked(avltree) || avl_tracked(out))
+		return errno = EINVAL, -1;
 
-	newnode = avl_alloc(avltree, item);
-	if(newnode)
-		return avl_insert_right(avltree, newnode);
-	return NULL;
+	rest = *avltree;
+	(void)avl_tree_clear(&rest);
+
+	(void)avl_tree_split(avltree, to, &rest);
+	(void)avl_tree_split(avltree, from, out);
+	(void)avl_tree_concat(avltree, &rest);
+
+	return 0;
 }
+#endif
 
-avl_node_t *avl_unlink(avl_tree_t *avltree, avl_node_t *avlnode) {
-	avl_node_t *parent;
-	avl_node_t **superparent;
-	avl_node_t *subst, *left, *right;
-	avl_node_t *balnode;
+/* Unlinks the node that *path[n - 1] refers to, using the path from the
+ * top of the tree instead of the parent pointers to rebalance.
+ * O(lg n) */
+static avl_node_t *avl_unlink_path(avl_tree_t *avltree, avl_node_t ***path, int n) {
+	avl_node_t **link, *avlnode, *parent, *left, *right, *subst;
+	int i, m, k;
 
-	if(!avltree || !avlnode)
-		return NULL;
+	link = path[n - 1];
+	avlnode = *link;
+	parent = avlnode->parent;
+	left = avlnode->left;
+	right = avlnode->right;
+
+	avl_hash_remove(avltree, avlnode);
+	avl_hook_unlinked(avltree, avlnode);
 
+#	ifdef AVL_NO_LIST
+	if(avlnode == avltree->head)
+		avltree->head = avl_next(avlnode);
+	if(avlnode == avltree->tail)
+		avltree->tail = avl_prev(avlnode);
+#	else
 	if(avlnode->prev)
 		avlnode->prev->next = avlnode->next;
 	else
@@ -675,62 +2984,214 @@ avl_node_t *avl_unlink(avl_tree_t *avltree, avl_node_t *avlnode) {
 		avlnode->next->prev = avlnode->prev;
 	else
 		avltree->tail = avlnode->prev;
+#	endif
 
-	parent = avlnode->parent;
-
-	superparent = parent
-		? avlnode == parent->left ? &parent->left : &parent->right
-		: &avltree->top;
+	n--;
+	k = n;
 
-	left = avlnode->left;
-	right = avlnode->right;
-	if(!left) {
-		*superparent = right;
-		if(right)
-			right->parent = parent;
-		balnode = parent;
-	} else if(!right) {
-		*superparent = left;
-		left->parent = parent;
-		balnode = parent;
+	if(!left || !right) {
+		subst = left ? left : right;
+		*link = subst;
+		if(subst)
+			subst->parent = parent;
 	} else {
-		subst = avlnode->prev;
-		if(subst == left) {
-			balnode = subst;
-		} else {
-			balnode = subst->parent;
-			balnode->right = subst->left;
-			if(balnode->right)
-				balnode->right->parent = balnode;
+		/* The in-order predecessor takes the place of the node. The
+		 * path gets extended with the nodes on the way down to it. */
+		m = n;
+		path[m++] = link;
+		path[m++] = &avlnode->left;
+		for(subst = left; subst->right; subst = subst->right)
+			path[m++] = &subst->right;
+		m--;
+
+		if(subst != left) {
+			parent = subst->parent;
+			parent->right = subst->left;
+			if(subst->left)
+				subst->left->parent = parent;
 			subst->left = left;
 			left->parent = subst;
+			path[n + 1] = &subst->left;
 		}
+
 		subst->right = right;
-		subst->parent = parent;
 		right->parent = subst;
-		*superparent = subst;
+		subst->parent = avlnode->parent;
+#		ifdef AVL_COUNT
+		subst->count = avlnode->count;
+#		endif
+#		ifdef AVL_DEPTH
+		subst->depth = avlnode->depth;
+#		endif
+#		ifdef AVL_MERKLE
+		subst->digest = avlnode->digest;
+#		endif
+		*link = subst;
+		n = m;
 	}
 
-	avl_rebalance(avltree, balnode);
+	/* The subtrees on the path down to where avlnode was lose its
+	 * copies, those below it (down to where subst was) lose subst's. */
+#	ifdef AVL_COUNT
+	for(i = 0; i < n; i++)
+		(*path[i])->count -= i <= k ? NODE_MULT(avlnode) : NODE_MULT(subst);
+#	else
+	(void)i;
+	(void)k;
+#	endif
+#	ifdef AVL_MERKLE
+	for(i = 0; i < n; i++)
+		(*path[i])->digest -= i <= k ? OWN_DIGEST(avlnode) : OWN_DIGEST(subst);
+#	endif
+
+	avl_rebalance_path(path, n);
 
 	return avlnode;
 }
 
-void *avl_delete(avl_tree_t *avltree, avl_node_t *avlnode) {
-	void *item = NULL;
-	if(avlnode) {
-		item = avlnode->item;
-		(void)avl_unlink(avltree, avlnode);
-		if(avltree->free)
-			avltree->free(item, avltree->userdata);
-		avl_node_free(avltree, avlnode);
+void *avl_item_delete(avl_tree_t *avltree, const void *item) {
+	avl_node_t **path[AVL_MAX_HEIGHT];
+	avl_node_t **link, *node;
+	avl_cmp_t cmp;
+	void *userdata;
+	int c, n;
+
+	if(!avltree)
+		return NULL;
+
+	cmp = avltree->cmp;
+	userdata = avltree->userdata;
+
+	link = &avltree->top;
+	n = 0;
+	while((node = *link)) {
+		path[n++] = link;
+		c = cmp(item, node->item, userdata);
+		if(!c)
+			break;
+		link = c < 0 ? &node->left : &node->right;
 	}
-	return item;
+	if(!node)
+		return NULL;
+
+	item = node->item;
+	(void)avl_unlink_path(avltree, path, n);
+	avl_hook_deleted(avltree, node);
+	if(avltree->free)
+		avltree->free(node->item, avltree->userdata);
+	avl_node_free(avltree, node);
+	return avl_const_item(item);
 }
 
-void *avl_item_delete(avl_tree_t *avltree, const void *item) {
-	return avl_delete(avltree, avl_search(avltree, item));
+avl_node_t *avl_reinsert(avl_tree_t *avltree, avl_node_t *avlnode, const void *item) {
+	avl_node_t **path[AVL_MAX_HEIGHT];
+	avl_node_t *node, *parent, *prev, *next;
+	avl_cmp_t cmp;
+	void *userdata;
+	int n, i;
+
+	if(!avltree || !avlnode)
+		return NULL;
+
+	cmp = avltree->cmp;
+	userdata = avltree->userdata;
+
+	prev = NODE_PREV(avlnode);
+	next = NODE_NEXT(avlnode);
+	if((!prev || cmp(prev->item, item, userdata) <= 0)
+	&& (!next || cmp(item, next->item, userdata) < 0)) {
+		avl_hash_remove(avltree, avlnode);
+		avl_hook_unlinked(avltree, avlnode);
+		avlnode->item = avl_const_item(item);
+		avl_hash_add(avltree, avlnode);
+		avl_merkle_rehash(avltree, avlnode);
+		avl_hook_inserted(avltree, avlnode);
+		return avlnode;
+	}
+
+	/* Reconstruct the path from the top down to the node, so that
+	 * both the removal and the insertion can stop rebalancing early. */
+	n = 1;
+	for(node = avlnode; node->parent; node = node->parent)
+		n++;
+	i = n;
+	for(node = avlnode; (parent = node->parent); node = parent)
+		path[--i] = node == parent->left ? &parent->left : &parent->right;
+	path[--i] = &avltree->top;
+
+	(void)avl_unlink_path(avltree, path, n);
+	avlnode->item = avl_const_item(item);
+	return avl_insert_path(avltree, avlnode, 0);
+}
+
+#ifdef AVL_MULTISET
+/* Adds delta (which may wrap around, to subtract) to the multiplicity
+ * of the node and the counts of the subtrees that contain it.
+ * O(lg n) */
+static void avl_multiply(avl_node_t *avlnode, unsigned long delta) {
+#	ifdef AVL_MERKLE
+	unsigned long digest = avlnode->hash * delta;
+#	endif
+
+	avlnode->multiplicity += delta;
+	for(; avlnode; avlnode = avlnode->parent) {
+		avlnode->count += delta;
+#		ifdef AVL_MERKLE
+		avlnode->digest += digest;
+#		endif
+	}
+}
+
+avl_node_t *avl_item_add(avl_tree_t *avltree, const void *item, unsigned long n) {
+	avl_node_t *node;
+
+	if(!avltree)
+		return errno = EFAULT, (avl_node_t *)NULL;
+
+	node = avl_search(avltree, item);
+	if(node) {
+		if(n) {
+			avl_multiply(node, n);
+			avl_hook_inserted(avltree, node);
+		}
+		return node;
+	}
+
+	if(!n)
+		return errno = EINVAL, (avl_node_t *)NULL;
+
+	node = avl_alloc(avltree, item);
+	if(!node)
+		return NULL;
+	node->multiplicity = n;
+	if(avl_insert(avltree, node))
+		return node;
+	avl_node_free(avltree, node);
+	return NULL;
+}
+
+unsigned long avl_item_remove(avl_tree_t *avltree, const void *item, unsigned long n) {
+	avl_node_t *node;
+
+	/* Nothing changes, so the hooks must not hear of it either. */
+	if(!avltree || !n)
+		return 0;
+
+	node = avl_search(avltree, item);
+	if(!node)
+		return 0;
+
+	if(n < node->multiplicity) {
+		avl_multiply(node, -n);
+		avl_hook_inserted(avltree, node);
+		return n;
+	}
+
+	n = node->multiplicity;
+	(void)avl_delete(avltree, node);
+	return n;
 }
+#endif
 
 avl_node_t *avl_fixup(avl_tree_t *avltree, avl_node_t *newnode) {
 	avl_node_t *oldnode = NULL, *node;
@@ -738,6 +3199,29 @@ avl_node_t *avl_fixup(avl_tree_t *avltree, avl_node_t *newnode) {
 	if(!avltree || !newnode)
 		return NULL;
 
+#	ifdef AVL_NO_LIST
+	/* Without the list, find the old location through the children
+	 * or, for leaves, by deciding which child of the parent it was. */
+	node = newnode->parent;
+	if(newnode->left)
+		oldnode = newnode->left->parent;
+	else if(newnode->right)
+		oldnode = newnode->right->parent;
+	else if(!node)
+		oldnode = avltree->top;
+	else if(!node->right)
+		oldnode = node->left;
+	else if(!node->left)
+		oldnode = node->right;
+	else
+		oldnode = avltree->cmp(newnode->item, node->item, avltree->userdata) < 0
+			? node->left : node->right;
+
+	if(avltree->head == oldnode)
+		avltree->head = newnode;
+	if(avltree->tail == oldnode)
+		avltree->tail = newnode;
+#	else
 	node = newnode->prev;
 	if(node) {
 		oldnode = node->next;
@@ -753,6 +3237,7 @@ avl_node_t *avl_fixup(avl_tree_t *avltree, avl_node_t *newnode) {
 	} else {
 		avltree->tail = newnode;
 	}
+#	endif
 
 	node = newnode->parent;
 	if(node) {
@@ -765,151 +3250,265 @@ avl_node_t *avl_fixup(avl_tree_t *avltree, avl_node_t *newnode) {
 		avltree->top = newnode;
 	}
 
+	if(newnode->left)
+		newnode->left->parent = newnode;
+	if(newnode->right)
+		newnode->right->parent = newnode;
+
+	avl_hash_move(avltree, oldnode, newnode);
+
 	return oldnode;
 }
 
 /*
- * avl_rebalance:
- * Rebalances the tree if one side becomes too heavy.  This function
- * assumes that both subtrees are AVL-trees with consistant data.  The
- * function has the additional side effect of recalculating the count of
- * the tree at this node.  It should be noted that at the return of this
- * function, if a rebalance takes place, the top of this subtree is no
- * longer going to be the same node.
+ * avl_balance_node:
+ * Restores the balance of a single node whose subtrees are balanced
+ * and consistent, rotating if necessary, and recalculates its count and
+ * depth. superparent is the pointer that refers to the node (in its
+ * parent or the tree). After a rotation, *superparent is the new top of
+ * this subtree.
  */
-static void avl_rebalance(avl_tree_t *avltree, avl_node_t *avlnode) {
+static void avl_balance_node(avl_node_t **superparent, avl_node_t *avlnode) {
 	avl_node_t *child;
 	avl_node_t *gchild;
 	avl_node_t *parent;
-	avl_node_t **superparent;
-
-	parent = avlnode;
-
-	while(avlnode) {
-		parent = avlnode->parent;
 
-		superparent = parent
-			? avlnode == parent->left ? &parent->left : &parent->right
-			: &avltree->top;
+	parent = avlnode->parent;
 
-		switch(avl_check_balance(avlnode)) {
-		case -1:
-			child = avlnode->left;
-#			ifdef AVL_DEPTH
-			if(L_DEPTH(child) >= R_DEPTH(child)) {
-#			else
+	switch(avl_check_balance(avlnode)) {
+	case -1:
+		child = avlnode->left;
+#		ifdef AVL_DEPTH
+		if(L_DEPTH(child) >= R_DEPTH(child)) {
+#		else
+#		ifdef AVL_COUNT
+		if(R_WEIGHT(child) < AVL_WEIGHT_GAMMA * L_WEIGHT(child)) {
+#		else
+#		error No balancing possible.
+#		endif
+#		endif
+			avlnode->left = child->right;
+			if(avlnode->left)
+				avlnode->left->parent = avlnode;
+			child->right = avlnode;
+			avlnode->parent = child;
+			*superparent = child;
+			child->parent = parent;
 #			ifdef AVL_COUNT
-			if(L_COUNT(child) >= R_COUNT(child)) {
-#			else
-#			error No balancing possible.
+			avlnode->count = CALC_COUNT(avlnode);
+			child->count = CALC_COUNT(child);
 #			endif
+#			ifdef AVL_DEPTH
+			avlnode->depth = CALC_DEPTH(avlnode);
+			child->depth = CALC_DEPTH(child);
+#			endif
+#			ifdef AVL_MERKLE
+			avlnode->digest = CALC_DIGEST(avlnode);
+			child->digest = CALC_DIGEST(child);
+#			endif
+		} else {
+			gchild = child->right;
+			avlnode->left = gchild->right;
+			if(avlnode->left)
+				avlnode->left->parent = avlnode;
+			child->right = gchild->left;
+			if(child->right)
+				child->right->parent = child;
+			gchild->right = avlnode;
+			if(gchild->right)
+				gchild->right->parent = gchild;
+			gchild->left = child;
+			if(gchild->left)
+				gchild->left->parent = gchild;
+			*superparent = gchild;
+			gchild->parent = parent;
+#			ifdef AVL_COUNT
+			avlnode->count = CALC_COUNT(avlnode);
+			child->count = CALC_COUNT(child);
+			gchild->count = CALC_COUNT(gchild);
 #			endif
-				avlnode->left = child->right;
-				if(avlnode->left)
-					avlnode->left->parent = avlnode;
-				child->right = avlnode;
-				avlnode->parent = child;
-				*superparent = child;
-				child->parent = parent;
-#				ifdef AVL_COUNT
-				avlnode->count = CALC_COUNT(avlnode);
-				child->count = CALC_COUNT(child);
-#				endif
-#				ifdef AVL_DEPTH
-				avlnode->depth = CALC_DEPTH(avlnode);
-				child->depth = CALC_DEPTH(child);
-#				endif
-			} else {
-				gchild = child->right;
-				avlnode->left = gchild->right;
-				if(avlnode->left)
-					avlnode->left->parent = avlnode;
-				child->right = gchild->left;
-				if(child->right)
-					child->right->parent = child;
-				gchild->right = avlnode;
-				if(gchild->right)
-					gchild->right->parent = gchild;
-				gchild->left = child;
-				if(gchild->left)
-					gchild->left->parent = gchild;
-				*superparent = gchild;
-				gchild->parent = parent;
-#				ifdef AVL_COUNT
-				avlnode->count = CALC_COUNT(avlnode);
-				child->count = CALC_COUNT(child);
-				gchild->count = CALC_COUNT(gchild);
-#				endif
-#				ifdef AVL_DEPTH
-				avlnode->depth = CALC_DEPTH(avlnode);
-				child->depth = CALC_DEPTH(child);
-				gchild->depth = CALC_DEPTH(gchild);
-#				endif
-			}
-		break;
-		case 1:
-			child = avlnode->right;
 #			ifdef AVL_DEPTH
-			if(R_DEPTH(child) >= L_DEPTH(child)) {
-#			else
+			avlnode->depth = CALC_DEPTH(avlnode);
+			child->depth = CALC_DEPTH(child);
+			gchild->depth = CALC_DEPTH(gchild);
+#			endif
+#			ifdef AVL_MERKLE
+			avlnode->digest = CALC_DIGEST(avlnode);
+			child->digest = CALC_DIGEST(child);
+			gchild->digest = CALC_DIGEST(gchild);
+#			endif
+		}
+	break;
+	case 1:
+		child = avlnode->right;
+#		ifdef AVL_DEPTH
+		if(R_DEPTH(child) >= L_DEPTH(child)) {
+#		else
+#		ifdef AVL_COUNT
+		if(L_WEIGHT(child) < AVL_WEIGHT_GAMMA * R_WEIGHT(child)) {
+#		else
+#		error No balancing possible.
+#		endif
+#		endif
+			avlnode->right = child->left;
+			if(avlnode->right)
+				avlnode->right->parent = avlnode;
+			child->left = avlnode;
+			avlnode->parent = child;
+			*superparent = child;
+			child->parent = parent;
 #			ifdef AVL_COUNT
-			if(R_COUNT(child) >= L_COUNT(child)) {
-#			else
-#			error No balancing possible.
+			avlnode->count = CALC_COUNT(avlnode);
+			child->count = CALC_COUNT(child);
+#			endif
+#			ifdef AVL_DEPTH
+			avlnode->depth = CALC_DEPTH(avlnode);
+			child->depth = CALC_DEPTH(child);
 #			endif
+#			ifdef AVL_MERKLE
+			avlnode->digest = CALC_DIGEST(avlnode);
+			child->digest = CALC_DIGEST(child);
 #			endif
-				avlnode->right = child->left;
-				if(avlnode->right)
-					avlnode->right->parent = avlnode;
-				child->left = avlnode;
-				avlnode->parent = child;
-				*superparent = child;
-				child->parent = parent;
-#				ifdef AVL_COUNT
-				avlnode->count = CALC_COUNT(avlnode);
-				child->count = CALC_COUNT(child);
-#				endif
-#				ifdef AVL_DEPTH
-				avlnode->depth = CALC_DEPTH(avlnode);
-				child->depth = CALC_DEPTH(child);
-#				endif
-			} else {
-				gchild = child->left;
-				avlnode->right = gchild->left;
-				if(avlnode->right)
-					avlnode->right->parent = avlnode;
-				child->left = gchild->right;
-				if(child->left)
-					child->left->parent = child;
-				gchild->left = avlnode;
-				if(gchild->left)
-					gchild->left->parent = gchild;
-				gchild->right = child;
-				if(gchild->right)
-					gchild->right->parent = gchild;
-				*superparent = gchild;
-				gchild->parent = parent;
-#				ifdef AVL_COUNT
-				avlnode->count = CALC_COUNT(avlnode);
-				child->count = CALC_COUNT(child);
-				gchild->count = CALC_COUNT(gchild);
-#				endif
-#				ifdef AVL_DEPTH
-				avlnode->depth = CALC_DEPTH(avlnode);
-				child->depth = CALC_DEPTH(child);
-				gchild->depth = CALC_DEPTH(gchild);
-#				endif
-			}
-		break;
-		default:
+		} else {
+			gchild = child->left;
+			avlnode->right = gchild->left;
+			if(avlnode->right)
+				avlnode->right->parent = avlnode;
+			child->left = gchild->right;
+			if(child->left)
+				child->left->parent = child;
+			gchild->left = avlnode;
+			if(gchild->left)
+				gchild->left->parent = gchild;
+			gchild->right = child;
+			if(gchild->right)
+				gchild->right->parent = gchild;
+			*superparent = gchild;
+			gchild->parent = parent;
 #			ifdef AVL_COUNT
 			avlnode->count = CALC_COUNT(avlnode);
+			child->count = CALC_COUNT(child);
+			gchild->count = CALC_COUNT(gchild);
 #			endif
 #			ifdef AVL_DEPTH
 			avlnode->depth = CALC_DEPTH(avlnode);
+			child->depth = CALC_DEPTH(child);
+			gchild->depth = CALC_DEPTH(gchild);
+#			endif
+#			ifdef AVL_MERKLE
+			avlnode->digest = CALC_DIGEST(avlnode);
+			child->digest = CALC_DIGEST(child);
+			gchild->digest = CALC_DIGEST(gchild);
 #			endif
 		}
+	break;
+	default:
+#		ifdef AVL_COUNT
+		avlnode->count = CALC_COUNT(avlnode);
+#		endif
+#		ifdef AVL_DEPTH
+		avlnode->depth = CALC_DEPTH(avlnode);
+#		endif
+#		ifdef AVL_MERKLE
+		avlnode->digest = CALC_DIGEST(avlnode);
+#		endif
+	}
+}
+
+/*
+ * avl_rebalance:
+ * Rebalances the tree if one side becomes too heavy.  This function
+ * assumes that both subtrees are AVL-trees with consistant data.  The
+ * function has the additional side effect of recalculating the count of
+ * the tree at this node.  It should be noted that at the return of this
+ * function, if a rebalance takes place, the top of this subtree is no
+ * longer going to be the same node.
+ */
+static void avl_rebalance(avl_tree_t *avltree, avl_node_t *avlnode) {
+	avl_node_t *parent;
+	avl_node_t **superparent;
+
+	while(avlnode) {
+		parent = avlnode->parent;
+
+		superparent = parent
+			? avlnode == parent->left ? &parent->left : &parent->right
+			: &avltree->top;
+
+		avl_balance_node(superparent, avlnode);
+
+		avlnode = parent;
+	}
+}
+
+/*
+ * avl_rebalance_insert:
+ * Like avl_rebalance(), for newnode that was just linked in below
+ * avlnode. When balancing on depth, the rebalancing stops as soon as a
+ * subtree ends up as high as it was, and the nodes above it only get
+ * the new node added to their counts (and digests). A rotation may
+ * have put newnode on top of a subtree, so only its own share counts.
+ */
+static void avl_rebalance_insert(avl_tree_t *avltree, avl_node_t *avlnode, const avl_node_t *newnode) {
+#	ifdef AVL_DEPTH
+	avl_node_t *parent;
+	avl_node_t **superparent;
+	unsigned char depth;
+
+	while(avlnode) {
+		parent = avlnode->parent;
+
+		superparent = parent
+			? avlnode == parent->left ? &parent->left : &parent->right
+			: &avltree->top;
+
+		depth = avlnode->depth;
+		avl_balance_node(superparent, avlnode);
+
 		avlnode = parent;
+		if((*superparent)->depth == depth)
+			break;
+	}
+
+	for(; avlnode; avlnode = avlnode->parent) {
+#		ifdef AVL_COUNT
+		avlnode->count += NODE_MULT(newnode);
+#		endif
+#		ifdef AVL_MERKLE
+		avlnode->digest += OWN_DIGEST(newnode);
+#		endif
+	}
+#	else
+	(void)newnode;
+	avl_rebalance(avltree, avlnode);
+#	endif
+}
+
+/*
+ * avl_rebalance_path:
+ * Like avl_rebalance(), but works its way up a stack of pointers that
+ * refer to the nodes on the path from the top to the changed node,
+ * rather than following parent pointers. The counts on the path must
+ * already have been adjusted by the caller. When balancing on depth,
+ * the walk stops as soon as a subtree ends up as high as it was, since
+ * nothing above it can have changed.
+ */
+static void avl_rebalance_path(avl_node_t ***path, int n) {
+	avl_node_t **link;
+#	ifdef AVL_DEPTH
+	unsigned char depth;
+#	endif
+
+	while(n--) {
+		link = path[n];
+#		ifdef AVL_DEPTH
+		depth = (*link)->depth;
+#		endif
+		avl_balance_node(link, *link);
+#		ifdef AVL_DEPTH
+		if((*link)->depth == depth)
+			break;
+#		endif
 	}
 }
 
@@ -939,6 +3538,28 @@ AVL_CMP_DEFINE_T(ssize)
 
 AVL_CMP_DEFINE_NAMED(pointer, const void *)
 
+__attribute__((pure))
+int avl_bytes_cmp(const void *a, const void *b, void *userdata) {
+	const avl_bytes_t *x = a, *y = b;
+	int r = memcmp(x->data, y->data, x->size < y->size ? x->size : y->size);
+	if(r)
+		return AVL_CMP(r, 0);
+	return AVL_CMP(x->size, y->size);
+}
+
+/* With a constant size, memcmp() gets inlined by most compilers. */
+#define AVL_MEMCMP_DEFINE(n, size) \
+	__attribute__((pure)) \
+	int avl_##n##_cmp(const void *a, const void *b, void *userdata) { \
+		int r = memcmp(a, b, (size)); \
+		return AVL_CMP(r, 0); \
+	}
+
+AVL_MEMCMP_DEFINE(mem16, 16)
+AVL_MEMCMP_DEFINE(mem20, 20)
+AVL_MEMCMP_DEFINE(mem32, 32)
+AVL_MEMCMP_DEFINE(memcmp, (size_t)userdata)
+
 #ifdef __GNUC__
 AVL_CMP_DEFINE_NAMED(long_long, long long)
 AVL_CMP_DEFINE_NAMED(unsigned_long_long, unsigned long long)
@@ -972,11 +3593,37 @@ AVL_CMP_DEFINE_T(int_least32)
 AVL_CMP_DEFINE_T(uint_least32)
 AVL_CMP_DEFINE_T(int_least64)
 AVL_CMP_DEFINE_T(uint_least64)
+
+#define AVL_CMP_DEFINE_TUPLE(t, k) \
+	__attribute__((pure)) \
+	int avl_##t##x##k##_cmp(const void *a, const void *b, void *userdata) { \
+		const t##_t *x = a, *y = b; \
+		int i; \
+		for(i = 0; i < k - 1; i++) \
+			if(x[i] != y[i]) \
+				break; \
+		return AVL_CMP(x[i], y[i]); \
+	}
+
+AVL_CMP_DEFINE_TUPLE(int32, 2)
+AVL_CMP_DEFINE_TUPLE(int32, 3)
+AVL_CMP_DEFINE_TUPLE(int32, 4)
+AVL_CMP_DEFINE_TUPLE(uint32, 2)
+AVL_CMP_DEFINE_TUPLE(uint32, 3)
+AVL_CMP_DEFINE_TUPLE(uint32, 4)
+AVL_CMP_DEFINE_TUPLE(int64, 2)
+AVL_CMP_DEFINE_TUPLE(int64, 3)
+AVL_CMP_DEFINE_TUPLE(int64, 4)
+AVL_CMP_DEFINE_TUPLE(uint64, 2)
+AVL_CMP_DEFINE_TUPLE(uint64, 3)
+AVL_CMP_DEFINE_TUPLE(uint64, 4)
 #endif
 
 #if AVL_HAVE_POSIX
+#include <strings.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 
 AVL_CMP_DEFINE_T(time)
 AVL_CMP_DEFINE_T(off)
@@ -1007,4 +3654,50 @@ __attribute__((pure))
 int avl_strcasecmp(const void *a, const void *b, void *userdata) {
 	return strcasecmp(a, b);
 }
+
+__attribute__((pure))
+int avl_in_addr_cmp(const void *a, const void *b, void *userdata) {
+	return AVL_CMP(ntohl(((const struct in_addr *)a)->s_addr), ntohl(((const struct in_addr *)b)->s_addr));
+}
+
+__attribute__((pure))
+int avl_in6_addr_cmp(const void *a, const void *b, void *userdata) {
+	int r = memcmp(a, b, sizeof(struct in6_addr));
+	return AVL_CMP(r, 0);
+}
+
+__attribute__((pure))
+int avl_sockaddr_cmp(const void *a, const void *b, void *userdata) {
+	const struct sockaddr *x = a, *y = b;
+	const struct sockaddr_in *x4, *y4;
+	const struct sockaddr_in6 *x6, *y6;
+	int r;
+
+	r = AVL_CMP(x->sa_family, y->sa_family);
+	if(r)
+		return r;
+
+	switch(x->sa_family) {
+	case AF_INET:
+		x4 = a;
+		y4 = b;
+		r = avl_in_addr_cmp(&x4->sin_addr, &y4->sin_addr, userdata);
+		if(r)
+			return r;
+		return AVL_CMP(ntohs(x4->sin_port), ntohs(y4->sin_port));
+	case AF_INET6:
+		x6 = a;
+		y6 = b;
+		r = avl_in6_addr_cmp(&x6->sin6_addr, &y6->sin6_addr, userdata);
+		if(r)
+			return r;
+		r = AVL_CMP(ntohs(x6->sin6_port), ntohs(y6->sin6_port));
+		if(r)
+			return r;
+		return AVL_CMP(x6->sin6_scope_id, y6->sin6_scope_id);
+	default:
+		r = memcmp(x->sa_data, y->sa_data, sizeof x->sa_data);
+		return AVL_CMP(r, 0);
+	}
+}
 #endif
@@ -0,0 +1,351 @@
+/*****************************************************************************
+
+	avl_arena.c - Huge page node arenas for libavl
+
+	Copyright (c) 2000-2009  Wessel Dankers <wsl@fruit.je>
+
+	This file is part of libavl.
+
+	libavl is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as
+	published by the Free Software Foundation, either version 3 of
+	the License, or (at your option) any later version.
+
+	libavl is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	and a copy of the GNU Lesser General Public License along with
+	libavl.  If not, see <http://www.gnu.org/licenses/>.
+
+	Node allocator that carves nodes out of large chunks of memory that
+	are backed by huge pages where possible, so that searches through a
+	big tree need far fewer TLB entries. Each chunk is first requested
+	from the hugetlbfs pool (MAP_HUGETLB); if that is empty, the chunk is
+	mapped at a huge page boundary and offered to transparent huge pages
+	(MADV_HUGEPAGE); failing that, it is used with normal pages. Freed
+	nodes are kept on a free list and memory only goes back to the
+	system when the allocator is destroyed.
+
+	The compactor moves the nodes of a tree into such an arena a few at
+	a time, in order, so that neighbouring nodes end up next to each
+	other in memory. While it runs, it sits between the tree and both
+	allocators to send each freed node back to where it came from.
+
+*****************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "avl.h"
+
+#if AVL_HAVE_POSIX
+#include <pthread.h>
+
+/* Size of the chunks; a multiple of the huge page size. */
+#ifndef AVL_ARENA_CHUNK
+#define AVL_ARENA_CHUNK (32UL << 20)
+#endif
+
+#define AVL_ARENA_ALIGN (2UL << 20)
+
+/* With counts, a compaction that lost its place finds it again by rank.
+ * Multiplicities can change without any node being freed, which would
+ * throw the ranks off. */
+#if defined(AVL_COUNT) && !defined(AVL_MULTISET)
+#define AVL_COMPACT_RANK
+#endif
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+typedef struct avl_arena_chunk {
+	struct avl_arena_chunk *next;
+	void *base;
+} avl_arena_chunk_t;
+
+typedef struct avl_arena_allocator {
+	avl_allocator_t allocator;
+	pthread_mutex_t lock;
+	int want;
+	int got;
+	avl_arena_chunk_t *chunks;
+	char *next;
+	char *end;
+	avl_node_t *free;
+} avl_arena_allocator_t;
+
+/* Maps a chunk of AVL_ARENA_CHUNK bytes and notes what it is backed by. */
+static void *avl_arena_map(avl_arena_allocator_t *arena) {
+	char *p, *q;
+	size_t size = AVL_ARENA_CHUNK;
+
+#	ifdef MAP_HUGETLB
+	if(arena->want & AVL_ARENA_HUGETLB) {
+		p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if(p != MAP_FAILED) {
+			arena->got |= AVL_ARENA_HUGETLB;
+			return p;
+		}
+	}
+#	endif
+
+	/* Map an extra huge page so that the chunk can be aligned, and
+	 * trim what is left over on either side. */
+	p = mmap(NULL, size + AVL_ARENA_ALIGN, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(p == MAP_FAILED)
+		return NULL;
+	q = (char *)(((uintptr_t)p + AVL_ARENA_ALIGN - 1) & ~(uintptr_t)(AVL_ARENA_ALIGN - 1));
+	if(q > p)
+		munmap(p, q - p);
+	munmap(q + size, p + AVL_ARENA_ALIGN - q);
+
+#	ifdef MADV_HUGEPAGE
+	if(arena->want & AVL_ARENA_THP && !madvise(q, size, MADV_HUGEPAGE)) {
+		arena->got |= AVL_ARENA_THP;
+		return q;
+	}
+#	endif
+
+	arena->got |= AVL_ARENA_NORMAL;
+	return q;
+}
+
+static avl_node_t *avl_arena_allocate(avl_allocator_t *allocator) {
+	avl_arena_allocator_t *arena = (avl_arena_allocator_t *)allocator;
+	avl_arena_chunk_t *chunk;
+	avl_node_t *node;
+
+	pthread_mutex_lock(&arena->lock);
+
+	node = arena->free;
+	if(node) {
+		arena->free = node->right;
+		pthread_mutex_unlock(&arena->lock);
+		return node;
+	}
+
+	if(arena->end - arena->next < (ptrdiff_t)sizeof *node) {
+		chunk = malloc(sizeof *chunk);
+		if(chunk)
+			chunk->base = avl_arena_map(arena);
+		if(!chunk || !chunk->base) {
+			free(chunk);
+			pthread_mutex_unlock(&arena->lock);
+			return errno = ENOMEM, (avl_node_t *)NULL;
+		}
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->next = chunk->base;
+		arena->end = arena->next + AVL_ARENA_CHUNK;
+	}
+
+	node = (avl_node_t *)arena->next;
+	arena->next += sizeof *node;
+
+	pthread_mutex_unlock(&arena->lock);
+	return node;
+}
+
+static void avl_arena_deallocate(avl_allocator_t *allocator, avl_node_t *node) {
+	avl_arena_allocator_t *arena = (avl_arena_allocator_t *)allocator;
+
+	pthread_mutex_lock(&arena->lock);
+	node->right = arena->free;
+	arena->free = node;
+	pthread_mutex_unlock(&arena->lock);
+}
+
+avl_allocator_t *avl_arena_allocator_new(int pages) {
+	avl_arena_allocator_t *arena;
+	int err;
+
+	arena = calloc(1, sizeof *arena);
+	if(!arena)
+		return NULL;
+
+	arena->allocator.allocate = avl_arena_allocate;
+	arena->allocator.deallocate = avl_arena_deallocate;
+	arena->want = pages;
+
+	err = pthread_mutex_init(&arena->lock, NULL);
+	if(err) {
+		free(arena);
+		return errno = err, (avl_allocator_t *)NULL;
+	}
+
+	return &arena->allocator;
+}
+
+int avl_arena_allocator_pages(avl_allocator_t *allocator) {
+	avl_arena_allocator_t *arena = (avl_arena_allocator_t *)allocator;
+	int got;
+
+	if(!arena)
+		return 0;
+
+	pthread_mutex_lock(&arena->lock);
+	got = arena->got;
+	pthread_mutex_unlock(&arena->lock);
+
+	return got;
+}
+
+void avl_arena_allocator_free(avl_allocator_t *allocator) {
+	avl_arena_allocator_t *arena = (avl_arena_allocator_t *)allocator;
+	avl_arena_chunk_t *chunk, *next;
+
+	if(!arena)
+		return;
+
+	for(chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		munmap(chunk->base, AVL_ARENA_CHUNK);
+		free(chunk);
+	}
+
+	pthread_mutex_destroy(&arena->lock);
+	free(arena);
+}
+
+/* Whether a node lies in one of the chunks of the arena. */
+static int avl_arena_owns(avl_arena_allocator_t *arena, const avl_node_t *node) {
+	const avl_arena_chunk_t *chunk;
+	const char *p = (const char *)node;
+	int owns = 0;
+
+	pthread_mutex_lock(&arena->lock);
+	for(chunk = arena->chunks; chunk; chunk = chunk->next) {
+		if(p >= (const char *)chunk->base && p < (const char *)chunk->base + AVL_ARENA_CHUNK) {
+			owns = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&arena->lock);
+
+	return owns;
+}
+
+/* Hands a node that was not moved yet back to the old allocator. */
+static void avl_compact_release(avl_compact_t *compact, avl_node_t *node) {
+	avl_allocator_t *from = compact->from;
+
+	if(from) {
+		if(from->deallocate)
+			from->deallocate(from, node);
+	} else {
+		free(node);
+	}
+}
+
+static avl_node_t *avl_compact_allocate(avl_allocator_t *allocator) {
+	avl_compact_t *compact = (avl_compact_t *)allocator;
+
+	return compact->to->allocate(compact->to);
+}
+
+static void avl_compact_deallocate(avl_allocator_t *allocator, avl_node_t *node) {
+	avl_compact_t *compact = (avl_compact_t *)allocator;
+
+	/* Its item may be gone already, so the next step has to find its
+	 * place from the number of nodes that were freed in between. */
+	if(node == compact->last)
+		compact->last = NULL;
+	compact->freed++;
+
+	if(avl_arena_owns((avl_arena_allocator_t *)compact->to, node))
+		compact->to->deallocate(compact->to, node);
+	else
+		avl_compact_release(compact, node);
+}
+
+avl_compact_t *avl_compact_init(avl_compact_t *compact, avl_tree_t *avltree, avl_allocator_t *to) {
+	if(!compact || !avltree || !to)
+		return errno = EFAULT, (avl_compact_t *)NULL;
+
+	compact->allocator.allocate = avl_compact_allocate;
+	compact->allocator.deallocate = avl_compact_deallocate;
+	compact->tree = avltree;
+	compact->from = avltree->allocator;
+	compact->to = to;
+	compact->last = NULL;
+	compact->rank = 0;
+	compact->freed = 0;
+	compact->moved = 0;
+	compact->done = 0;
+
+	avltree->allocator = &compact->allocator;
+
+	return compact;
+}
+
+int avl_compact_step(avl_compact_t *compact, unsigned long max) {
+	avl_tree_t *avltree;
+	avl_allocator_t *to;
+	avl_node_t *node, *copy;
+	int skip = 0;
+
+	if(!compact)
+		return errno = EFAULT, -1;
+
+	if(compact->done)
+		return 0;
+
+	avltree = compact->tree;
+	to = compact->to;
+
+	if(compact->last) {
+		node = avl_next(compact->last);
+	} else {
+#		ifdef AVL_COMPACT_RANK
+		/* Every node before the one the walk stopped at is in the
+		 * arena, and its rank went down by at most one per node that
+		 * was freed since, so this revisits no more than those. */
+		node = avl_at(avltree, compact->rank > compact->freed ? compact->rank - compact->freed : 0);
+#		else
+		/* Start over; the nodes that were moved already are free. */
+		node = avltree->head;
+		skip = 1;
+#		endif
+	}
+	compact->freed = 0;
+
+	for(; node && max; node = avl_next(node)) {
+		if(!avl_arena_owns((avl_arena_allocator_t *)to, node)) {
+			copy = to->allocate(to);
+			if(!copy)
+				return -1;
+			*copy = *node;
+			avl_compact_release(compact, avl_fixup(avltree, copy));
+			node = copy;
+			compact->moved++;
+			skip = 0;
+		}
+		if(!skip)
+			max--;
+		compact->last = node;
+	}
+
+	if(node) {
+#		ifdef AVL_COMPACT_RANK
+		compact->rank = avl_index(node);
+#		endif
+		return 1;
+	}
+
+	avltree->allocator = to;
+	compact->last = NULL;
+	compact->done = 1;
+	return 0;
+}
+
+int avl_compact_finish(avl_compact_t *compact) {
+	return avl_compact_step(compact, ULONG_MAX) ? -1 : 0;
+}
+#endif
@@ -0,0 +1,100 @@
+/*****************************************************************************
+
+	avl_key.c - Order preserving key normalization for libavl
+
+	Copyright (c) 2000-2009  Wessel Dankers <wsl@fruit.je>
+
+	This file is part of libavl.
+
+	libavl is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as
+	published by the Free Software Foundation, either version 3 of
+	the License, or (at your option) any later version.
+
+	libavl is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	and a copy of the GNU Lesser General Public License along with
+	libavl.  If not, see <http://www.gnu.org/licenses/>.
+
+	Converts values to byte strings that memcmp() orders the same way
+	as the values themselves, so that composite keys can be compared
+	with a single memcmp() and stored prefix compressed.
+
+*****************************************************************************/
+
+#include <string.h>
+
+#include "avl.h"
+
+#if AVL_HAVE_C99
+size_t avl_key_uint32(void *buf, uint32_t v) {
+	unsigned char *p = buf;
+	if(p) {
+		p[0] = v >> 24;
+		p[1] = v >> 16;
+		p[2] = v >> 8;
+		p[3] = v;
+	}
+	return 4;
+}
+
+size_t avl_key_int32(void *buf, int32_t v) {
+	return avl_key_uint32(buf, (uint32_t)v ^ UINT32_C(0x80000000));
+}
+
+size_t avl_key_uint64(void *buf, uint64_t v) {
+	unsigned char *p = buf;
+	if(p) {
+		avl_key_uint32(p, v >> 32);
+		avl_key_uint32(p + 4, v);
+	}
+	return 8;
+}
+
+size_t avl_key_int64(void *buf, int64_t v) {
+	return avl_key_uint64(buf, (uint64_t)v ^ UINT64_C(0x8000000000000000));
+}
+
+/* Assumes IEEE 754 doubles. -0.0 sorts just before 0.0 and NaNs sort
+ * at the ends, according to their sign. */
+size_t avl_key_double(void *buf, double d) {
+	uint64_t v;
+
+	memcpy(&v, &d, sizeof v);
+	if(v & UINT64_C(0x8000000000000000))
+		v = ~v;
+	else
+		v ^= UINT64_C(0x8000000000000000);
+
+	return avl_key_uint64(buf, v);
+}
+
+size_t avl_key_bytes(void *buf, const void *data, size_t size) {
+	const unsigned char *s = data;
+	unsigned char *p = buf;
+	size_t i, len = size + 2;
+
+	for(i = 0; i < size; i++) {
+		if(p)
+			*p++ = s[i];
+		if(!s[i]) {
+			if(p)
+				*p++ = 0xFF;
+			len++;
+		}
+	}
+
+	if(p)
+		p[0] = p[1] = 0;
+
+	return len;
+}
+
+size_t avl_key_string(void *buf, const char *s) {
+	return avl_key_bytes(buf, s, strlen(s));
+}
+#endif
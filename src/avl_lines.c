@@ -0,0 +1,207 @@
+/*****************************************************************************
+
+	avl_lines.c - Files of lines for libavl
+
+	Copyright (c) 2000-2009  Wessel Dankers <wsl@fruit.je>
+
+	This file is part of libavl.
+
+	libavl is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as
+	published by the Free Software Foundation, either version 3 of
+	the License, or (at your option) any later version.
+
+	libavl is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	and a copy of the GNU Lesser General Public License along with
+	libavl.  If not, see <http://www.gnu.org/licenses/>.
+
+	Regular files are mmap()ed; pipes and the like are read into a
+	buffer. Either way the lines are referenced where they are, as
+	avl_bytes_t keys, so that loading a file costs one pass over it and
+	one allocation for the keys. Whether the file is sorted is noted
+	on the way, as the previous line is still in the cache; nodes are
+	only allocated when a tree is asked for.
+
+*****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "avl.h"
+
+#if AVL_HAVE_POSIX
+static const avl_lines_t avl_lines_0;
+
+/* Reads what can't be mapped. */
+static int avl_lines_read(avl_lines_t *lines, int fd) {
+	char *data, *p;
+	size_t size = 0, cap = 65536;
+	ssize_t r;
+
+	data = malloc(cap);
+	if(!data)
+		return -1;
+
+	for(;;) {
+		if(size == cap) {
+			p = realloc(data, cap *= 2);
+			if(!p) {
+				free(data);
+				return -1;
+			}
+			data = p;
+		}
+		r = read(fd, data + size, cap - size);
+		if(r < 0) {
+			if(errno == EINTR)
+				continue;
+			free(data);
+			return -1;
+		}
+		if(!r)
+			break;
+		size += r;
+	}
+
+	lines->data = data;
+	lines->size = size;
+	return 0;
+}
+
+static int avl_lines_split(avl_lines_t *lines) {
+	const char *p, *e, *end;
+	avl_bytes_t *keys, *k;
+	unsigned long n = 0, cap = 0;
+
+	keys = NULL;
+	p = lines->data;
+	end = p + lines->size;
+	lines->sorted = 1;
+
+	for(; p < end; p = e + 1) {
+		e = memchr(p, '\n', end - p);
+		if(!e)
+			e = end;
+		if(n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			k = realloc(keys, cap * sizeof *keys);
+			if(!k) {
+				free(keys);
+				return -1;
+			}
+			keys = k;
+		}
+		k = keys + n++;
+		k->data = p;
+		k->size = e - p;
+		if(lines->sorted && n > 1 && avl_bytes_cmp(k - 1, k, NULL) > 0)
+			lines->sorted = 0;
+	}
+
+	lines->lines = keys;
+	lines->count = n;
+	return 0;
+}
+
+int avl_lines_load(avl_lines_t *lines, int fd) {
+	struct stat st;
+	void *map;
+
+	if(!lines)
+		return errno = EFAULT, -1;
+
+	*lines = avl_lines_0;
+	avl_tree_init(&lines->tree, avl_bytes_cmp, NULL);
+
+	if(!fstat(fd, &st) && S_ISREG(st.st_mode)
+	&& st.st_size > 0 && (off_t)(size_t)st.st_size == st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(map != MAP_FAILED) {
+			lines->data = map;
+			lines->size = st.st_size;
+			lines->mapped = 1;
+		}
+	}
+
+	if(!lines->mapped && avl_lines_read(lines, fd))
+		return -1;
+
+	if(avl_lines_split(lines)) {
+		avl_lines_free(lines);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Orders pointers to keys like avl_bytes_cmp(), and equal keys on
+ * their position in the file. */
+static int avl_lines_order(const void *a, const void *b) {
+	const avl_bytes_t *const *x = a, *const *y = b;
+	int c;
+
+	c = avl_bytes_cmp(*x, *y, NULL);
+	return c ? c : AVL_CMP(*x, *y);
+}
+
+avl_tree_t *avl_lines_tree(avl_lines_t *lines) {
+	const avl_bytes_t **order = NULL;
+	avl_node_t *node;
+	unsigned long i;
+
+	if(!lines)
+		return errno = EFAULT, (avl_tree_t *)NULL;
+
+	if(lines->nodes || !lines->count)
+		return &lines->tree;
+
+	lines->nodes = malloc(lines->count * sizeof *lines->nodes);
+	if(!lines->nodes)
+		return NULL;
+
+	/* Inserting in random order would cost a cache miss or two per
+	 * level of the tree; sorting the keys first and appending the
+	 * nodes one after the other is several times faster. */
+	if(!lines->sorted) {
+		order = malloc(lines->count * sizeof *order);
+		if(!order) {
+			free(lines->nodes);
+			lines->nodes = NULL;
+			return NULL;
+		}
+		for(i = 0; i < lines->count; i++)
+			order[i] = lines->lines + i;
+		qsort(order, lines->count, sizeof *order, avl_lines_order);
+	}
+
+	for(i = 0; i < lines->count; i++) {
+		node = avl_node_init(lines->nodes + i, order ? order[i] : lines->lines + i);
+		(void)avl_insert_after(&lines->tree, lines->tree.tail, node);
+	}
+	free(order);
+
+	return &lines->tree;
+}
+
+void avl_lines_free(avl_lines_t *lines) {
+	if(!lines)
+		return;
+
+	if(lines->mapped)
+		munmap(lines->data, lines->size);
+	else
+		free(lines->data);
+	free(lines->lines);
+	free(lines->nodes);
+
+	*lines = avl_lines_0;
+}
+#endif
@@ -0,0 +1,234 @@
+/*****************************************************************************
+
+	avl_log.c - Change logs and delta checkpoints for libavl
+
+	Copyright (c) 2000-2009  Wessel Dankers <wsl@fruit.je>
+
+	This file is part of libavl.
+
+	libavl is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as
+	published by the Free Software Foundation, either version 3 of
+	the License, or (at your option) any later version.
+
+	libavl is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	and a copy of the GNU Lesser General Public License along with
+	libavl.  If not, see <http://www.gnu.org/licenses/>.
+
+	The log hooks into a tree and keeps a second tree with one entry for
+	each item that was inserted or taken out since the last checkpoint.
+	An entry refers to the item in the tree for as long as it is there;
+	when it leaves, the entry gets a copy. What the tree holds now is
+	only looked up when the log is dumped, so an item that changes many
+	times costs one entry, and one that comes and goes again still
+	shows up with its current state.
+
+*****************************************************************************/
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "avl.h"
+
+/* The node must come first: the changes tree frees entries as nodes. */
+typedef struct avl_log_entry {
+	avl_node_t node;
+	int copied;
+} avl_log_entry_t;
+
+static avl_log_entry_t *avl_log_find(const avl_log_t *log, const void *item) {
+	return (avl_log_entry_t *)avl_search(&log->changes, item);
+}
+
+/* Adds an entry for item; a copy is freed if that fails. */
+static void avl_log_note(avl_log_t *log, const void *item, int copied) {
+	avl_log_entry_t *entry;
+
+	entry = malloc(sizeof *entry);
+	if(entry) {
+		entry->copied = copied;
+		if(avl_insert(&log->changes, avl_node_init(&entry->node, item))) {
+			log->count++;
+			return;
+		}
+		free(entry);
+	}
+
+	if(copied && log->free)
+		log->free((void *)item, log->tree->userdata);
+	log->lost = 1;
+}
+
+static void avl_log_inserted(avl_hooks_t *hooks, avl_tree_t *avltree, avl_node_t *avlnode) {
+	avl_log_t *log = (avl_log_t *)hooks;
+	avl_log_entry_t *entry;
+	void *copy;
+
+	entry = avl_log_find(log, avlnode->item);
+	if(!entry) {
+		avl_log_note(log, avlnode->item, 0);
+		return;
+	}
+
+	/* Refer to the item in the tree again. */
+	if(entry->node.item != avlnode->item) {
+		copy = entry->copied ? entry->node.item : NULL;
+		(void)avl_reinsert(&log->changes, &entry->node, avlnode->item);
+		entry->copied = 0;
+		if(copy && log->free)
+			log->free(copy, avltree->userdata);
+	}
+}
+
+static void avl_log_unlinked(avl_hooks_t *hooks, avl_tree_t *avltree, avl_node_t *avlnode) {
+	avl_log_t *log = (avl_log_t *)hooks;
+	avl_log_entry_t *entry;
+	void *item = avlnode->item;
+
+	entry = avl_log_find(log, item);
+	if(entry && (entry->copied || entry->node.item != item))
+		return;
+
+	if(log->copy) {
+		item = log->copy(item, avltree->userdata);
+		if(!item) {
+			log->lost = 1;
+			return;
+		}
+	}
+
+	if(entry) {
+		(void)avl_reinsert(&log->changes, &entry->node, item);
+		entry->copied = !!log->copy;
+	} else {
+		avl_log_note(log, item, !!log->copy);
+	}
+}
+
+/* Frees all entries and the copies they hold. */
+static void avl_log_forget(avl_log_t *log) {
+	avl_node_t *node;
+
+	if(log->free)
+		for(node = log->changes.head; node; node = avl_next(node))
+			if(((avl_log_entry_t *)node)->copied)
+				log->free(node->item, log->tree->userdata);
+
+	(void)avl_tree_purge(&log->changes);
+	log->count = 0;
+}
+
+avl_log_t *avl_log_init(avl_log_t *log, avl_tree_t *avltree, avl_copy_t copy, avl_free_t free) {
+	if(!log || !avltree)
+		return errno = EFAULT, (avl_log_t *)NULL;
+
+	log->hooks.inserted = avl_log_inserted;
+	log->hooks.unlinked = avl_log_unlinked;
+	log->hooks.deleted = NULL;
+	log->tree = avltree;
+	avl_tree_init(&log->changes, avltree->cmp, NULL);
+	log->changes.userdata = avltree->userdata;
+	log->copy = copy;
+	log->free = free;
+	log->epoch = 0;
+	log->count = 0;
+	log->lost = 0;
+
+	avltree->hooks = &log->hooks;
+
+	return log;
+}
+
+unsigned long avl_log_count(const avl_log_t *log) {
+	return log ? log->count : 0;
+}
+
+int avl_log_dump(const avl_log_t *log, avl_delta_t delta, void *userdata) {
+	const avl_node_t *node, *found;
+	unsigned long n;
+	int r;
+
+	if(!log || !delta)
+		return errno = EFAULT, -1;
+	if(log->lost)
+		return errno = ENOMEM, -1;
+
+	for(node = log->changes.head; node; node = avl_next(node)) {
+		found = avl_search(log->tree, node->item);
+#		ifdef AVL_MULTISET
+		n = found ? found->multiplicity : 0;
+#		else
+		n = found ? 1 : 0;
+#		endif
+		r = delta(found ? found->item : node->item, n, userdata);
+		if(r)
+			return r;
+	}
+
+	return 0;
+}
+
+unsigned long avl_log_checkpoint(avl_log_t *log) {
+	if(!log)
+		return 0;
+
+	avl_log_forget(log);
+	log->lost = 0;
+
+	return ++log->epoch;
+}
+
+void avl_log_free(avl_log_t *log) {
+	if(!log)
+		return;
+
+	avl_log_forget(log);
+	if(log->tree->hooks == &log->hooks)
+		log->tree->hooks = NULL;
+}
+
+int avl_delta_apply(avl_tree_t *avltree, const void *item, unsigned long n) {
+	avl_node_t *node;
+	void *old;
+
+	if(!avltree)
+		return errno = EFAULT, -1;
+
+	node = avl_search(avltree, item);
+
+	if(!n) {
+		if(node)
+			(void)avl_delete(avltree, node);
+		return 0;
+	}
+
+	if(!node) {
+#		ifdef AVL_MULTISET
+		node = avl_item_add(avltree, item, n);
+#		else
+		node = avl_item_insert(avltree, item);
+#		endif
+		return node ? 0 : -1;
+	}
+
+	old = node->item;
+	if(old != item) {
+		(void)avl_reinsert(avltree, node, item);
+		if(avltree->free)
+			avltree->free(old, avltree->userdata);
+	}
+
+#	ifdef AVL_MULTISET
+	if(n > node->multiplicity)
+		(void)avl_item_add(avltree, item, n - node->multiplicity);
+	else if(n < node->multiplicity)
+		(void)avl_item_remove(avltree, item, node->multiplicity - n);
+#	endif
+
+	return 0;
+}
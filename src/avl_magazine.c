@@ -0,0 +1,269 @@
+/*****************************************************************************
+
+	avl_magazine.c - Magazine node allocator for libavl
+
+	Copyright (c) 2000-2009  Wessel Dankers <wsl@fruit.je>
+
+	This file is part of libavl.
+
+	libavl is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as
+	published by the Free Software Foundation, either version 3 of
+	the License, or (at your option) any later version.
+
+	libavl is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	and a copy of the GNU Lesser General Public License along with
+	libavl.  If not, see <http://www.gnu.org/licenses/>.
+
+	Node allocator with per-thread caches, after Jeff Bonwick's
+	"Magazines and Vmem" (USENIX 2001). Every thread holds two
+	magazines (stacks of free nodes); only when both are exhausted
+	(or both are full) does it go to the shared depot, and then it
+	swaps entire magazines at once.
+
+*****************************************************************************/
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "avl.h"
+
+#if AVL_HAVE_POSIX
+#include <pthread.h>
+
+#ifndef AVL_MAGAZINE_SIZE
+#define AVL_MAGAZINE_SIZE 64
+#endif
+
+typedef struct avl_magazine {
+	struct avl_magazine *next;
+	unsigned int rounds;
+	avl_node_t *round[AVL_MAGAZINE_SIZE];
+} avl_magazine_t;
+
+typedef struct avl_magazine_allocator {
+	avl_allocator_t allocator;
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	avl_magazine_t *full;
+	avl_magazine_t *empty;
+} avl_magazine_allocator_t;
+
+typedef struct avl_magazine_cache {
+	avl_magazine_allocator_t *depot;
+	avl_magazine_t *loaded;
+	avl_magazine_t *previous;
+} avl_magazine_cache_t;
+
+static void avl_magazine_return(avl_magazine_allocator_t *depot, avl_magazine_t *mag) {
+	if(!mag)
+		return;
+	pthread_mutex_lock(&depot->lock);
+	if(mag->rounds) {
+		mag->next = depot->full;
+		depot->full = mag;
+	} else {
+		mag->next = depot->empty;
+		depot->empty = mag;
+	}
+	pthread_mutex_unlock(&depot->lock);
+}
+
+/* Called on thread exit: hand both magazines back to the depot. */
+static void avl_magazine_cache_free(void *arg) {
+	avl_magazine_cache_t *cache = arg;
+
+	avl_magazine_return(cache->depot, cache->loaded);
+	avl_magazine_return(cache->depot, cache->previous);
+	free(cache);
+}
+
+static avl_magazine_cache_t *avl_magazine_cache(avl_magazine_allocator_t *depot) {
+	avl_magazine_cache_t *cache;
+
+	cache = pthread_getspecific(depot->key);
+	if(cache)
+		return cache;
+
+	cache = calloc(1, sizeof *cache);
+	if(!cache)
+		return NULL;
+	cache->depot = depot;
+
+	if(pthread_setspecific(depot->key, cache)) {
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+static avl_node_t *avl_magazine_allocate(avl_allocator_t *allocator) {
+	avl_magazine_allocator_t *depot = (avl_magazine_allocator_t *)allocator;
+	avl_magazine_cache_t *cache;
+	avl_magazine_t *mag;
+
+	cache = avl_magazine_cache(depot);
+	if(!cache)
+		return malloc(sizeof(avl_node_t));
+
+	for(;;) {
+		mag = cache->loaded;
+		if(mag && mag->rounds)
+			return mag->round[--mag->rounds];
+
+		mag = cache->previous;
+		if(mag && mag->rounds) {
+			cache->previous = cache->loaded;
+			cache->loaded = mag;
+			continue;
+		}
+
+		pthread_mutex_lock(&depot->lock);
+		mag = depot->full;
+		if(mag) {
+			depot->full = mag->next;
+			if(cache->previous) {
+				cache->previous->next = depot->empty;
+				depot->empty = cache->previous;
+			}
+			cache->previous = cache->loaded;
+			cache->loaded = mag;
+		}
+		pthread_mutex_unlock(&depot->lock);
+
+		if(!mag)
+			return malloc(sizeof(avl_node_t));
+	}
+}
+
+static void avl_magazine_deallocate(avl_allocator_t *allocator, avl_node_t *node) {
+	avl_magazine_allocator_t *depot = (avl_magazine_allocator_t *)allocator;
+	avl_magazine_cache_t *cache;
+	avl_magazine_t *mag;
+
+	cache = avl_magazine_cache(depot);
+	if(!cache) {
+		free(node);
+		return;
+	}
+
+	for(;;) {
+		mag = cache->loaded;
+		if(mag && mag->rounds < AVL_MAGAZINE_SIZE) {
+			mag->round[mag->rounds++] = node;
+			return;
+		}
+
+		mag = cache->previous;
+		if(!mag || mag->rounds < AVL_MAGAZINE_SIZE) {
+			cache->previous = cache->loaded;
+			cache->loaded = mag;
+			if(mag)
+				continue;
+		}
+
+		/* Both magazines are full (or missing): trade the previous
+		 * one in for an empty magazine from the depot. */
+		pthread_mutex_lock(&depot->lock);
+		mag = depot->empty;
+		if(mag)
+			depot->empty = mag->next;
+		pthread_mutex_unlock(&depot->lock);
+
+		if(!mag) {
+			mag = malloc(sizeof *mag);
+			if(!mag) {
+				free(node);
+				return;
+			}
+		}
+		mag->rounds = 0;
+
+		avl_magazine_return(depot, cache->previous);
+		cache->previous = cache->loaded;
+		cache->loaded = mag;
+	}
+}
+
+static void avl_magazine_list_free(avl_magazine_t *mag) {
+	avl_magazine_t *next;
+	unsigned int i;
+
+	for(; mag; mag = next) {
+		next = mag->next;
+		for(i = 0; i < mag->rounds; i++)
+			free(mag->round[i]);
+		free(mag);
+	}
+}
+
+avl_allocator_t *avl_magazine_allocator_new(void) {
+	avl_magazine_allocator_t *depot;
+	int err;
+
+	depot = malloc(sizeof *depot);
+	if(!depot)
+		return NULL;
+
+	depot->allocator.allocate = avl_magazine_allocate;
+	depot->allocator.deallocate = avl_magazine_deallocate;
+	depot->full = depot->empty = NULL;
+
+	err = pthread_mutex_init(&depot->lock, NULL);
+	if(err) {
+		free(depot);
+		return errno = err, (avl_allocator_t *)NULL;
+	}
+
+	err = pthread_key_create(&depot->key, avl_magazine_cache_free);
+	if(err) {
+		pthread_mutex_destroy(&depot->lock);
+		free(depot);
+		return errno = err, (avl_allocator_t *)NULL;
+	}
+
+	return &depot->allocator;
+}
+
+void avl_magazine_allocator_reap(avl_allocator_t *allocator) {
+	avl_magazine_allocator_t *depot = (avl_magazine_allocator_t *)allocator;
+	avl_magazine_t *full, *empty;
+
+	if(!depot)
+		return;
+
+	pthread_mutex_lock(&depot->lock);
+	full = depot->full;
+	empty = depot->empty;
+	depot->full = depot->empty = NULL;
+	pthread_mutex_unlock(&depot->lock);
+
+	avl_magazine_list_free(full);
+	avl_magazine_list_free(empty);
+}
+
+void avl_magazine_allocator_free(avl_allocator_t *allocator) {
+	avl_magazine_allocator_t *depot = (avl_magazine_allocator_t *)allocator;
+	avl_magazine_cache_t *cache;
+
+	if(!depot)
+		return;
+
+	cache = pthread_getspecific(depot->key);
+	if(cache) {
+		pthread_setspecific(depot->key, NULL);
+		avl_magazine_cache_free(cache);
+	}
+
+	pthread_key_delete(depot->key);
+	avl_magazine_allocator_reap(allocator);
+	pthread_mutex_destroy(&depot->lock);
+	free(depot);
+}
+#endif
@@ -0,0 +1,196 @@
+/*****************************************************************************
+
+	avl_parallel.c - Parallel traversal of trees for libavl
+
+	Copyright (c) 2000-2009  Wessel Dankers <wsl@fruit.je>
+
+	This file is part of libavl.
+
+	libavl is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as
+	published by the Free Software Foundation, either version 3 of
+	the License, or (at your option) any later version.
+
+	libavl is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	and a copy of the GNU Lesser General Public License along with
+	libavl.  If not, see <http://www.gnu.org/licenses/>.
+
+	The tree is cut into as many ranges of equal rank as there are
+	threads. The first node of each range is found with avl_at_many(),
+	which shares the descent to all of them, and each thread then walks
+	its range with avl_next() until it reaches the start of the next
+	one. Nothing in the tree is written to, so the threads need no
+	locking beyond handing out the ranges. Without counts there is no
+	cheap way to find the ranges and the tree is walked by the calling
+	thread alone.
+
+*****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "avl.h"
+
+#if AVL_HAVE_POSIX
+#include <pthread.h>
+
+typedef struct avl_parallel_job {
+	avl_node_t **starts;
+	unsigned int nranges;
+	unsigned int next;
+	pthread_mutex_t lock;
+	avl_visit_t visit;
+	avl_fold_t fold;
+	char *accs;
+	size_t size;
+	void *userdata;
+} avl_parallel_job_t;
+
+/* Walks the ranges that no other thread has taken yet. */
+static void *avl_parallel_worker(void *arg) {
+	avl_parallel_job_t *job = arg;
+	const avl_node_t *node, *end;
+	unsigned int i;
+	void *acc;
+
+	for(;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if(i >= job->nranges)
+			break;
+
+		end = i + 1 < job->nranges ? job->starts[i + 1] : NULL;
+		if(job->fold) {
+			acc = job->accs + i * job->size;
+			for(node = job->starts[i]; node != end; node = avl_next(node))
+				job->fold(acc, node->item, job->userdata);
+		} else {
+			for(node = job->starts[i]; node != end; node = avl_next(node))
+				job->visit(node->item, job->userdata);
+		}
+	}
+
+	return NULL;
+}
+
+/* The number of ranges to cut the tree into: no more than there are
+ * nodes, and at least one. */
+static unsigned int avl_parallel_threads(const avl_tree_t *avltree, unsigned int threads) {
+#	ifdef AVL_COUNT
+	if(threads > avl_count(avltree))
+		threads = avl_count(avltree);
+#	else
+	threads = 1;
+#	endif
+	return threads ? threads : 1;
+}
+
+/* Splits the tree into ranges and has the threads walk them. */
+static int avl_parallel_run(const avl_tree_t *avltree, unsigned int threads, avl_parallel_job_t *job) {
+	unsigned long *ranks;
+#	ifdef AVL_COUNT
+	unsigned long count;
+#	endif
+	pthread_t *tids;
+	unsigned int i, started;
+	int err;
+
+	threads = avl_parallel_threads(avltree, threads);
+
+	job->nranges = threads;
+	job->next = 0;
+	job->starts = malloc(threads * sizeof *job->starts);
+	ranks = malloc(threads * sizeof *ranks);
+	tids = malloc(threads * sizeof *tids);
+	err = pthread_mutex_init(&job->lock, NULL);
+	if(!job->starts || !ranks || !tids || err) {
+		free(job->starts);
+		free(ranks);
+		free(tids);
+		if(err)
+			errno = err;
+		else
+			pthread_mutex_destroy(&job->lock);
+		return -1;
+	}
+
+#	ifdef AVL_COUNT
+	count = avl_count(avltree);
+	for(i = 0; i < threads; i++)
+		ranks[i] = count / threads * i + count % threads * i / threads;
+	avl_at_many(avltree, ranks, threads, job->starts);
+#	else
+	job->starts[0] = avltree->head;
+#	endif
+	free(ranks);
+
+	/* If threads can't be started, the others do their work. */
+	for(started = 1; started < threads; started++)
+		if(pthread_create(tids + started, NULL, avl_parallel_worker, job))
+			break;
+	avl_parallel_worker(job);
+	for(i = 1; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&job->lock);
+	free(tids);
+	free(job->starts);
+
+	return 0;
+}
+
+int avl_tree_parallel_for(const avl_tree_t *avltree, unsigned int threads, avl_visit_t visit, void *userdata) {
+	avl_parallel_job_t job;
+
+	if(!avltree || !visit)
+		return errno = EFAULT, -1;
+
+	job.visit = visit;
+	job.fold = NULL;
+	job.userdata = userdata;
+
+	return avl_parallel_run(avltree, threads, &job);
+}
+
+int avl_tree_parallel_reduce(const avl_tree_t *avltree, unsigned int threads, void *acc, size_t size, avl_fold_t fold, avl_merge_t merge, void *userdata) {
+	avl_parallel_job_t job;
+	unsigned int i;
+
+	if(!avltree || !acc || !fold || !merge)
+		return errno = EFAULT, -1;
+
+	threads = avl_parallel_threads(avltree, threads);
+
+	/* Every range starts from a copy of the initial value. */
+	job.accs = malloc(threads * size);
+	if(!job.accs)
+		return -1;
+	for(i = 0; i < threads; i++)
+		memcpy(job.accs + i * size, acc, size);
+
+	job.visit = NULL;
+	job.fold = fold;
+	job.size = size;
+	job.userdata = userdata;
+
+	if(avl_parallel_run(avltree, threads, &job)) {
+		free(job.accs);
+		return -1;
+	}
+
+	/* Combine the results in order. */
+	memcpy(acc, job.accs, size);
+	for(i = 1; i < job.nranges; i++)
+		merge(acc, job.accs + i * size, userdata);
+	free(job.accs);
+
+	return 0;
+}
+#endif
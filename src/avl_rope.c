@@ -0,0 +1,242 @@
+/*****************************************************************************
+
+	avl_rope.c - Chunked sequences for libavl
+
+	Copyright (c) 2000-2009  Wessel Dankers <wsl@fruit.je>
+
+	This file is part of libavl.
+
+	libavl is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as
+	published by the Free Software Foundation, either version 3 of
+	the License, or (at your option) any later version.
+
+	libavl is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	and a copy of the GNU Lesser General Public License along with
+	libavl.  If not, see <http://www.gnu.org/licenses/>.
+
+	A rope stores its items in runs: each node points to an array of up
+	to chunk items and has a multiplicity equal to the length of its run.
+	The counts that the tree maintains then add up items rather than
+	nodes, so ranks can be looked up as usual, while the tree itself is
+	chunk times smaller and a walk over the items mostly stays inside
+	one array. Changing the length of a run only has to correct the
+	counts on the path to the top, as the shape of the tree stays the
+	same; runs are only added or removed through the tree functions.
+
+*****************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "avl.h"
+
+#ifdef AVL_MULTISET
+
+#ifndef AVL_ROPE_CHUNK
+#define AVL_ROPE_CHUNK 64
+#endif
+
+static void avl_rope_run_free(void *run, void *userdata) {
+	(void)userdata;
+	free(run);
+}
+
+/* Changes the length of a run, and the counts above it. */
+static void avl_rope_resize(avl_node_t *node, unsigned long size) {
+	avl_node_t *n;
+	unsigned long old = node->multiplicity;
+
+	node->multiplicity = size;
+	for(n = node; n; n = n->parent) {
+		n->count = n->count - old + size;
+#		ifdef AVL_MERKLE
+		n->digest = n->digest - node->hash * old + node->hash * size;
+#		endif
+	}
+}
+
+/* Finds the run that holds the item at *index, and replaces *index with
+ * the position of the item in it. */
+static avl_node_t *avl_rope_find(const avl_rope_t *rope, unsigned long *index) {
+	avl_node_t *node = rope->tree.top;
+	unsigned long i = *index, l;
+
+	while(node) {
+		l = node->left ? node->left->count : 0;
+		if(i < l) {
+			node = node->left;
+		} else {
+			i -= l;
+			if(i < node->multiplicity) {
+				*index = i;
+				return node;
+			}
+			i -= node->multiplicity;
+			node = node->right;
+		}
+	}
+
+	return NULL;
+}
+
+/* Adds a new run after node (or at the start, if node is NULL) with a
+ * copy of the size items at items. */
+static avl_node_t *avl_rope_add(avl_rope_t *rope, avl_node_t *node, void **items, unsigned long size) {
+	avl_node_t *newnode;
+	void **run;
+
+	run = malloc(rope->chunk * sizeof *run);
+	if(!run)
+		return NULL;
+
+	memcpy(run, items, size * sizeof *run);
+
+	newnode = avl_alloc(&rope->tree, run);
+	if(!newnode) {
+		free(run);
+		return NULL;
+	}
+	newnode->multiplicity = size;
+
+	return avl_insert_after(&rope->tree, node, newnode);
+}
+
+/* Moves the items of a run from pos onwards to a new run after it. */
+static avl_node_t *avl_rope_cut(avl_rope_t *rope, avl_node_t *node, unsigned long pos) {
+	avl_node_t *newnode;
+	unsigned long size = node->multiplicity;
+
+	newnode = avl_rope_add(rope, node, (void **)node->item + pos, size - pos);
+	if(!newnode)
+		return NULL;
+
+	/* The new run was counted in already; only the old one shrinks. */
+	avl_rope_resize(node, pos);
+
+	return newnode;
+}
+
+avl_rope_t *avl_rope_init(avl_rope_t *rope, unsigned long chunk) {
+	if(rope) {
+		avl_tree_init(&rope->tree, NULL, avl_rope_run_free);
+		/* A full run must split into two non-empty ones. */
+		rope->chunk = chunk > 1 ? chunk : chunk ? 2 : AVL_ROPE_CHUNK;
+	}
+	return rope;
+}
+
+unsigned long avl_rope_length(const avl_rope_t *rope) {
+	return rope ? avl_count(&rope->tree) : 0;
+}
+
+void *avl_rope_at(const avl_rope_t *rope, unsigned long index) {
+	avl_node_t *node;
+
+	if(!rope)
+		return errno = EFAULT, NULL;
+
+	node = avl_rope_find(rope, &index);
+	return node ? ((void **)node->item)[index] : NULL;
+}
+
+int avl_rope_insert(avl_rope_t *rope, unsigned long index, const void *item) {
+	avl_node_t *node, *next;
+	void *it = (void *)(uintptr_t)item;
+	void **run;
+
+	if(!rope)
+		return errno = EFAULT, -1;
+
+	if(index == avl_count(&rope->tree)) {
+		/* Appending is common enough to take the short cut. */
+		node = rope->tree.tail;
+		if(!node || node->multiplicity == rope->chunk)
+			return avl_rope_add(rope, node, &it, 1) ? 0 : -1;
+		index = node->multiplicity;
+	} else {
+		node = avl_rope_find(rope, &index);
+		if(!node)
+			return errno = EINVAL, -1;
+		if(node->multiplicity == rope->chunk) {
+			next = avl_rope_cut(rope, node, rope->chunk / 2);
+			if(!next)
+				return -1;
+			if(index >= node->multiplicity) {
+				index -= node->multiplicity;
+				node = next;
+			}
+		}
+	}
+
+	run = node->item;
+	memmove(run + index + 1, run + index, (node->multiplicity - index) * sizeof *run);
+	run[index] = it;
+	avl_rope_resize(node, node->multiplicity + 1);
+
+	return 0;
+}
+
+void *avl_rope_delete(avl_rope_t *rope, unsigned long index) {
+	avl_node_t *node;
+	void **run, *item;
+
+	if(!rope)
+		return errno = EFAULT, NULL;
+
+	node = avl_rope_find(rope, &index);
+	if(!node)
+		return errno = EINVAL, NULL;
+
+	run = node->item;
+	item = run[index];
+
+	if(node->multiplicity == 1) {
+		(void)avl_delete(&rope->tree, node);
+	} else {
+		memmove(run + index, run + index + 1, (node->multiplicity - index - 1) * sizeof *run);
+		avl_rope_resize(node, node->multiplicity - 1);
+	}
+
+	return item;
+}
+
+int avl_rope_split(avl_rope_t *rope, unsigned long index, avl_rope_t *rest) {
+	avl_node_t *node;
+	unsigned long pos = index;
+
+	if(!rope || !rest)
+		return errno = EFAULT, -1;
+	if(rest->tree.top || rest == rope || rest->chunk != rope->chunk)
+		return errno = EINVAL, -1;
+
+	/* Cut the run in two if the split falls inside it, so that the tree
+	 * can be split between nodes. */
+	node = avl_rope_find(rope, &pos);
+	if(node && pos && !avl_rope_cut(rope, node, pos))
+		return -1;
+
+	return avl_tree_split(&rope->tree, index, &rest->tree);
+}
+
+int avl_rope_concat(avl_rope_t *rope, avl_rope_t *other) {
+	if(!rope || !other)
+		return errno = EFAULT, -1;
+	if(other->chunk != rope->chunk)
+		return errno = EINVAL, -1;
+
+	return avl_tree_concat(&rope->tree, &other->tree);
+}
+
+void avl_rope_purge(avl_rope_t *rope) {
+	if(rope)
+		(void)avl_tree_purge(&rope->tree);
+}
+#endif
@@ -0,0 +1,355 @@
+/*****************************************************************************
+
+	avl_strtree.c - Prefix compressed string keys for libavl
+
+	Copyright (c) 2000-2009  Wessel Dankers <wsl@fruit.je>
+
+	This file is part of libavl.
+
+	libavl is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as
+	published by the Free Software Foundation, either version 3 of
+	the License, or (at your option) any later version.
+
+	libavl is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	and a copy of the GNU Lesser General Public License along with
+	libavl.  If not, see <http://www.gnu.org/licenses/>.
+
+	Trees of strings that own their keys. Keys are copied into an
+	arena of large chunks. A key that shares a long enough prefix with
+	a neighbour is stored as a reference to an anchor key (one that is
+	stored in full) plus the length of the shared prefix and its own
+	suffix. Anchors are reference counted, so they outlive their own
+	removal from the tree for as long as other keys refer to them.
+
+	Searches keep track of the common prefix of the search key with
+	the lower and upper bounds of the current subtree; all keys in the
+	subtree share the shorter of the two, so comparisons skip it.
+
+*****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "avl.h"
+
+#if AVL_HAVE_POSIX
+
+/* Chunks are aligned to their size, so that a key can find the chunk it
+ * lives in by masking its address. Keys that don't fit get a chunk of
+ * their own (a multiple of the size, but still aligned to it). */
+#ifndef AVL_STRTREE_CHUNK
+#define AVL_STRTREE_CHUNK 65536
+#endif
+
+/* Only share prefixes at least this long; shorter ones aren't worth
+ * the extra indirection when comparing. */
+#ifndef AVL_STRTREE_MIN_SHARE
+#define AVL_STRTREE_MIN_SHARE 8
+#endif
+
+#define AVL_STRTREE_ALIGN(n) (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+typedef struct avl_strchunk {
+	size_t used;
+	size_t live;
+} avl_strchunk_t;
+
+typedef struct avl_strarena {
+	avl_strchunk_t *current;
+} avl_strarena_t;
+
+typedef struct avl_strkey {
+	struct avl_strkey *anchor;
+	unsigned int refs;
+	unsigned int lcp;
+	unsigned int len;
+	unsigned char suffix[1];
+} avl_strkey_t;
+
+#define AVL_STRKEY_SIZE(len) AVL_STRTREE_ALIGN(offsetof(avl_strkey_t, suffix) + (len) + 1)
+#define AVL_STRCHUNK_HEADER AVL_STRTREE_ALIGN(sizeof(avl_strchunk_t))
+
+static avl_strchunk_t *avl_strchunk(const avl_strkey_t *key) {
+	return (avl_strchunk_t *)((uintptr_t)key & ~(uintptr_t)(AVL_STRTREE_CHUNK - 1));
+}
+
+static avl_strkey_t *avl_strarena_alloc(avl_strarena_t *arena, size_t size) {
+	avl_strchunk_t *chunk = arena->current;
+	size_t chunksize;
+	void *mem;
+
+	if(!chunk || chunk->used + size > AVL_STRTREE_CHUNK) {
+		chunksize = AVL_STRTREE_CHUNK;
+		while(chunksize < AVL_STRCHUNK_HEADER + size)
+			chunksize += AVL_STRTREE_CHUNK;
+		if(posix_memalign(&mem, AVL_STRTREE_CHUNK, chunksize))
+			return errno = ENOMEM, (avl_strkey_t *)NULL;
+		if(chunk && !chunk->live)
+			free(chunk);
+		chunk = arena->current = mem;
+		chunk->used = AVL_STRCHUNK_HEADER;
+		chunk->live = 0;
+	}
+
+	mem = (char *)chunk + chunk->used;
+	chunk->used += size;
+	chunk->live++;
+
+	return mem;
+}
+
+static void avl_strarena_free(avl_strarena_t *arena, avl_strkey_t *key) {
+	avl_strchunk_t *chunk = avl_strchunk(key);
+
+	if(--chunk->live)
+		return;
+	if(chunk == arena->current)
+		chunk->used = AVL_STRCHUNK_HEADER;
+	else
+		free(chunk);
+}
+
+static void avl_strkey_release(avl_strarena_t *arena, avl_strkey_t *key) {
+	avl_strkey_t *anchor;
+
+	while(key && !--key->refs) {
+		anchor = key->anchor;
+		avl_strarena_free(arena, key);
+		key = anchor;
+	}
+}
+
+static void avl_strtree_item_free(void *item, void *userdata) {
+	avl_strkey_release(userdata, item);
+}
+
+static size_t avl_strkey_length(const avl_strkey_t *key) {
+	return (size_t)key->lcp + key->len;
+}
+
+static const unsigned char *avl_strkey_prefix(const avl_strkey_t *key) {
+	return key->anchor ? key->anchor->suffix : key->suffix;
+}
+
+/* Compares s (of length n) with key, skipping the first *lcp bytes that
+ * are known to be equal. Sets *lcp to the length of their common prefix.
+ * Returns -1, 0 or 1, like strcmp() would. */
+static int avl_strkey_compare(const unsigned char *s, size_t n, const avl_strkey_t *key, size_t *lcp) {
+	const unsigned char *p;
+	size_t i = *lcp, len, end;
+
+	len = avl_strkey_length(key);
+	end = n < len ? n : len;
+
+	if(i < key->lcp) {
+		p = avl_strkey_prefix(key);
+		while(i < key->lcp && i < end && s[i] == p[i])
+			i++;
+		if(i < key->lcp && i < end) {
+			*lcp = i;
+			return AVL_CMP(s[i], p[i]);
+		}
+	}
+
+	p = key->suffix;
+	while(i < end && s[i] == p[i - key->lcp])
+		i++;
+	*lcp = i;
+
+	if(i < end)
+		return AVL_CMP(s[i], p[i - key->lcp]);
+	return AVL_CMP(n, len);
+}
+
+static unsigned char avl_strkey_byte(const avl_strkey_t *key, size_t i) {
+	return i < key->lcp
+		? avl_strkey_prefix(key)[i]
+		: key->suffix[i - key->lcp];
+}
+
+/* Only used by the generic functions, like avl_insert() on a node. */
+static int avl_strtree_cmp(const void *a, const void *b, void *userdata) {
+	const avl_strkey_t *x = a, *y = b;
+	size_t i, n, xn, yn;
+	unsigned char cx, cy;
+
+	xn = avl_strkey_length(x);
+	yn = avl_strkey_length(y);
+	n = xn < yn ? xn : yn;
+
+	for(i = 0; i < n; i++) {
+		cx = avl_strkey_byte(x, i);
+		cy = avl_strkey_byte(y, i);
+		if(cx != cy)
+			return AVL_CMP(cx, cy);
+	}
+
+	return AVL_CMP(xn, yn);
+}
+
+/* Descends to s, tracking the common prefix with the bounds. Returns
+ * the matching node, or NULL with *parent set to the node to attach s
+ * to and *c to the side (-1 for left, 1 for right). *lcp receives the
+ * longest common prefix of s with either of its neighbours, and
+ * *neighbour the neighbour in question. */
+static avl_node_t *avl_strtree_descend(const avl_tree_t *avltree, const unsigned char *s, size_t n, avl_node_t **parent, int *c, avl_node_t **neighbour, size_t *lcp) {
+	avl_node_t *node, *lo = NULL, *hi = NULL;
+	size_t llo = 0, lhi = 0, m;
+	int r = 0;
+
+	*parent = NULL;
+	for(node = avltree->top; node; node = r < 0 ? node->left : node->right) {
+		m = llo < lhi ? llo : lhi;
+		r = avl_strkey_compare(s, n, node->item, &m);
+		if(!r)
+			return node;
+		*parent = node;
+		if(r < 0) {
+			hi = node;
+			lhi = m;
+		} else {
+			lo = node;
+			llo = m;
+		}
+	}
+
+	*c = r;
+	if(neighbour) {
+		*neighbour = llo >= lhi ? lo : hi;
+		*lcp = llo >= lhi ? llo : lhi;
+	}
+	return NULL;
+}
+
+avl_tree_t *avl_strtree_init(avl_tree_t *avltree) {
+	return avl_tree_init(avltree, avl_strtree_cmp, avl_strtree_item_free);
+}
+
+avl_node_t *avl_strtree_insert(avl_tree_t *avltree, const char *str) {
+	const unsigned char *s = (const unsigned char *)str;
+	avl_strarena_t *arena;
+	avl_strkey_t *key, *anchor;
+	avl_node_t *parent, *neighbour, *newnode;
+	size_t n, lcp;
+	int c;
+
+	if(!avltree || !str)
+		return errno = EFAULT, (avl_node_t *)NULL;
+
+	n = strlen(str);
+	if(n > UINT_MAX)
+		return errno = ERANGE, (avl_node_t *)NULL;
+
+	if(avl_strtree_descend(avltree, s, n, &parent, &c, &neighbour, &lcp))
+		return errno = EEXIST, (avl_node_t *)NULL;
+
+	arena = avltree->userdata;
+	if(!arena) {
+		arena = calloc(1, sizeof *arena);
+		if(!arena)
+			return NULL;
+		avltree->userdata = arena;
+	}
+
+	/* Share with the neighbour's anchor (which shares at least as
+	 * much with the neighbour as the neighbour's prefix length). */
+	anchor = NULL;
+	if(neighbour && lcp >= AVL_STRTREE_MIN_SHARE) {
+		key = neighbour->item;
+		anchor = key->anchor ? key->anchor : key;
+		if(key->anchor && lcp > key->lcp)
+			lcp = key->lcp;
+		if(lcp < AVL_STRTREE_MIN_SHARE || anchor->refs == UINT_MAX)
+			anchor = NULL;
+	}
+	if(!anchor)
+		lcp = 0;
+
+	key = avl_strarena_alloc(arena, AVL_STRKEY_SIZE(n - lcp));
+	if(!key)
+		return NULL;
+	key->anchor = anchor;
+	key->refs = 1;
+	key->lcp = lcp;
+	key->len = n - lcp;
+	memcpy(key->suffix, s + lcp, n - lcp + 1);
+
+	newnode = avl_alloc(avltree, key);
+	if(!newnode) {
+		avl_strarena_free(arena, key);
+		return NULL;
+	}
+
+	if(anchor)
+		anchor->refs++;
+
+	if(!parent)
+		return avl_insert_after(avltree, NULL, newnode);
+	return c < 0
+		? avl_insert_before(avltree, parent, newnode)
+		: avl_insert_after(avltree, parent, newnode);
+}
+
+avl_node_t *avl_strtree_search(const avl_tree_t *avltree, const char *str) {
+	avl_node_t *parent;
+	int c;
+
+	if(!avltree || !str)
+		return NULL;
+
+	return avl_strtree_descend(avltree, (const unsigned char *)str, strlen(str), &parent, &c, NULL, NULL);
+}
+
+int avl_strtree_delete(avl_tree_t *avltree, const char *str) {
+	avl_node_t *node;
+
+	node = avl_strtree_search(avltree, str);
+	if(!node)
+		return errno = ENOENT, -1;
+
+	(void)avl_delete(avltree, node);
+	return 0;
+}
+
+size_t avl_strtree_key(const avl_node_t *avlnode, char *buf, size_t size) {
+	const avl_strkey_t *key = avlnode->item;
+	size_t n, lcp = key->lcp;
+
+	n = avl_strkey_length(key);
+	if(size) {
+		if(lcp >= size)
+			lcp = size - 1;
+		memcpy(buf, avl_strkey_prefix(key), lcp);
+		memcpy(buf + lcp, key->suffix, n < size ? n - lcp : size - 1 - lcp);
+		buf[n < size ? n : size - 1] = '\0';
+	}
+
+	return n;
+}
+
+avl_tree_t *avl_strtree_purge(avl_tree_t *avltree) {
+	avl_strarena_t *arena;
+
+	if(!avltree)
+		return NULL;
+
+	arena = avltree->userdata;
+	(void)avl_tree_purge(avltree);
+	if(arena) {
+		free(arena->current);
+		free(arena);
+		avltree->userdata = NULL;
+	}
+
+	return avltree;
+}
+#endif
@@ -0,0 +1,232 @@
+/*****************************************************************************
+
+	avl_timer.c - Timer queues for libavl
+
+	Copyright (c) 2000-2009  Wessel Dankers <wsl@fruit.je>
+
+	This file is part of libavl.
+
+	libavl is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as
+	published by the Free Software Foundation, either version 3 of
+	the License, or (at your option) any later version.
+
+	libavl is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	and a copy of the GNU Lesser General Public License along with
+	libavl.  If not, see <http://www.gnu.org/licenses/>.
+
+	Timers are intrusive nodes in a tree ordered on their deadline.
+	A timer is armed if its node has an item (the timer itself).
+	Timers that are due but whose callback hasn't run yet are kept on
+	a ring that is local to avl_timer_run(); their nodes point to
+	themselves as their parent.
+	Expiry finds the last timer that is due and unlinks everything up
+	to it with avl_unlink_upto(), so the tree is only touched once per
+	run no matter how many timers expire.
+
+*****************************************************************************/
+
+#include <limits.h>
+#include <time.h>
+
+#include "avl.h"
+
+#if AVL_HAVE_POSIX
+/* Compares the deadline of a timer with sec and nsec. */
+static int avl_timer_due(const avl_timer_t *timer, time_t sec, long nsec) {
+	return timer->sec == sec
+		? AVL_CMP(timer->nsec, nsec)
+		: AVL_CMP(timer->sec, sec);
+}
+
+static int avl_timer_cmp(const void *a, const void *b, void *userdata) {
+	const avl_timer_t *x = a, *y = b;
+	return avl_timer_due(x, y->sec, y->nsec);
+}
+
+static avl_timer_t *avl_timer_of(const avl_node_t *avlnode) {
+	return avlnode ? avlnode->item : NULL;
+}
+
+avl_tree_t *avl_timer_tree_init(avl_tree_t *avltree) {
+	return avl_tree_init(avltree, avl_timer_cmp, NULL);
+}
+
+avl_timer_t *avl_timer_init(avl_timer_t *timer) {
+	if(timer) {
+		avl_node_init(&timer->node, NULL);
+		timer->sec = 0;
+		timer->nsec = 0;
+	}
+	return timer;
+}
+
+int avl_timer_armed(const avl_timer_t *timer) {
+	return timer && timer->node.item;
+}
+
+static int avl_timer_pending(const avl_node_t *avlnode) {
+	return avlnode->parent == avlnode;
+}
+
+static void avl_timer_unpend(avl_node_t *avlnode) {
+	avlnode->left->right = avlnode->right;
+	avlnode->right->left = avlnode->left;
+	avlnode->parent = NULL;
+}
+
+static void avl_timer_unlink(avl_tree_t *avltree, avl_timer_t *timer) {
+	if(avl_timer_pending(&timer->node))
+		avl_timer_unpend(&timer->node);
+	else
+		(void)avl_unlink(avltree, &timer->node);
+}
+
+int avl_timer_cancel(avl_tree_t *avltree, avl_timer_t *timer) {
+	if(!avl_timer_armed(timer))
+		return 0;
+
+	avl_timer_unlink(avltree, timer);
+	timer->node.item = NULL;
+	return 1;
+}
+
+avl_timer_t *avl_timer_arm(avl_tree_t *avltree, avl_timer_t *timer, const struct timespec *deadline) {
+	avl_timer_t *prev, *next;
+	avl_node_t *tail;
+	time_t sec;
+	long nsec;
+
+	if(!avltree || !timer || !deadline)
+		return timer;
+
+	sec = deadline->tv_sec;
+	nsec = deadline->tv_nsec;
+
+	if(avl_timer_armed(timer) && !avl_timer_pending(&timer->node)) {
+		prev = avl_timer_of(avl_prev(&timer->node));
+		next = avl_timer_of(avl_next(&timer->node));
+		if((!prev || avl_timer_due(prev, sec, nsec) <= 0)
+		&& (!next || avl_timer_due(next, sec, nsec) > 0)) {
+			timer->sec = sec;
+			timer->nsec = nsec;
+			return timer;
+		}
+	}
+	if(avl_timer_armed(timer))
+		avl_timer_unlink(avltree, timer);
+
+	timer->sec = sec;
+	timer->nsec = nsec;
+	avl_node_init(&timer->node, timer);
+
+	tail = avltree->tail;
+	if(!tail || avl_timer_due(avl_timer_of(tail), sec, nsec) <= 0)
+		(void)avl_insert_after(avltree, tail, &timer->node);
+	else
+		(void)avl_insert_right(avltree, &timer->node);
+
+	return timer;
+}
+
+avl_timer_t *avl_timer_rearm(avl_tree_t *avltree, avl_timer_t *timer, const struct timespec *interval) {
+	struct timespec deadline;
+
+	if(!timer || !interval)
+		return timer;
+
+	deadline.tv_sec = timer->sec + interval->tv_sec;
+	deadline.tv_nsec = timer->nsec + interval->tv_nsec;
+	if(deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_nsec -= 1000000000L;
+		deadline.tv_sec++;
+	}
+
+	return avl_timer_arm(avltree, timer, &deadline);
+}
+
+int avl_timer_next(const avl_tree_t *avltree, struct timespec *deadline) {
+	avl_timer_t *timer;
+
+	timer = avltree ? avl_timer_of(avltree->head) : NULL;
+	if(!timer)
+		return -1;
+
+	deadline->tv_sec = timer->sec;
+	deadline->tv_nsec = timer->nsec;
+	return 0;
+}
+
+int avl_timer_timeout(const avl_tree_t *avltree, const struct timespec *now) {
+	avl_timer_t *timer;
+	time_t sec;
+	long nsec;
+
+	timer = avltree ? avl_timer_of(avltree->head) : NULL;
+	if(!timer)
+		return -1;
+
+	sec = timer->sec - now->tv_sec;
+	nsec = timer->nsec - now->tv_nsec;
+	if(nsec < 0) {
+		nsec += 1000000000L;
+		sec--;
+	}
+
+	if(sec < 0)
+		return 0;
+	if(sec >= INT_MAX / 1000 - 1)
+		return INT_MAX;
+	return sec * 1000 + (nsec + 999999) / 1000000;
+}
+
+unsigned long avl_timer_run(avl_tree_t *avltree, const struct timespec *now, avl_expire_t expire, void *userdata) {
+	avl_node_t pending, *node, *prev, *next;
+	unsigned long n = 0;
+
+	if(!avltree || !now)
+		return 0;
+
+	node = avltree->head;
+	if(!node || avl_timer_due(avl_timer_of(node), now->tv_sec, now->tv_nsec) > 0)
+		return 0;
+
+	/* Find the last timer that is due. */
+	for(prev = NULL, node = avltree->top; node;) {
+		if(avl_timer_due(avl_timer_of(node), now->tv_sec, now->tv_nsec) <= 0) {
+			prev = node;
+			node = node->right;
+		} else {
+			node = node->left;
+		}
+	}
+
+	/* Move all due timers to a ring of pending timers at once, so that
+	 * callbacks can cancel or rearm timers that haven't run yet. */
+	node = avl_unlink_upto(avltree, prev);
+	for(prev = &pending; node; node = next) {
+		next = node->right;
+		node->parent = node;
+		node->left = prev;
+		prev->right = node;
+		prev = node;
+	}
+	prev->right = &pending;
+	pending.left = prev;
+
+	while((node = pending.right) != &pending) {
+		avl_timer_unpend(node);
+		node->item = NULL;
+		n++;
+		if(expire)
+			expire((avl_timer_t *)((char *)node - offsetof(avl_timer_t, node)), userdata);
+	}
+
+	return n;
+}
+#endif
@@ -0,0 +1,114 @@
+/*****************************************************************************
+
+	avl_window.c - Sliding window order statistics for libavl
+
+	Copyright (c) 2000-2009  Wessel Dankers <wsl@fruit.je>
+
+	This file is part of libavl.
+
+	libavl is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as
+	published by the Free Software Foundation, either version 3 of
+	the License, or (at your option) any later version.
+
+	libavl is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	and a copy of the GNU Lesser General Public License along with
+	libavl.  If not, see <http://www.gnu.org/licenses/>.
+
+	A counted tree over the last n items of a stream. The nodes form a
+	ring in insertion order, so the node of the oldest item is always
+	the next one in the ring; it is recycled for every new item once
+	the window has filled up.
+
+*****************************************************************************/
+
+#include <stdlib.h>
+
+#include "avl.h"
+
+#ifdef AVL_COUNT
+avl_window_t *avl_window_init(avl_window_t *window, avl_node_t *ring, unsigned long size, avl_cmp_t cmp) {
+	if(window) {
+		avl_tree_init(&window->tree, cmp, NULL);
+		window->ring = ring;
+		window->size = size;
+		window->next = 0;
+	}
+	return window;
+}
+
+avl_window_t *avl_window_malloc(unsigned long size, avl_cmp_t cmp) {
+	avl_window_t *window;
+
+	if(size > ((size_t)-1 - sizeof *window) / sizeof(avl_node_t))
+		return NULL;
+
+	window = malloc(sizeof *window + size * sizeof(avl_node_t));
+	if(!window)
+		return NULL;
+
+	return avl_window_init(window, (avl_node_t *)(window + 1), size, cmp);
+}
+
+void avl_window_free(avl_window_t *window) {
+	free(window);
+}
+
+avl_window_t *avl_window_clear(avl_window_t *window) {
+	if(window) {
+		avl_tree_clear(&window->tree);
+		window->next = 0;
+	}
+	return window;
+}
+
+void *avl_window_push(avl_window_t *window, const void *item) {
+	avl_tree_t *avltree;
+	avl_node_t *node;
+	void *old;
+
+	if(!window || !window->size)
+		return NULL;
+
+	avltree = &window->tree;
+	node = window->ring + window->next;
+	if(++window->next == window->size)
+		window->next = 0;
+
+	/* Slots are used in order, so the window is full once the tree
+	 * holds as many nodes as there are slots. */
+	if(avl_count(avltree) == window->size) {
+		old = node->item;
+		(void)avl_reinsert(avltree, node, item);
+		return old;
+	}
+
+	(void)avl_insert_somewhere(avltree, avl_node_init(node, item));
+
+	return NULL;
+}
+
+void avl_window_quantiles(const avl_window_t *window, const double *q, unsigned long k, void **items) {
+	avl_node_t *nodes[64];
+	unsigned long i, j;
+
+	for(i = 0; i < k; i += j) {
+		j = k - i < 64 ? k - i : 64;
+		avl_quantiles(&window->tree, q + i, j, nodes);
+		for(j = 0; j < 64 && i + j < k; j++)
+			items[i + j] = nodes[j] ? nodes[j]->item : NULL;
+	}
+}
+
+void *avl_window_quantile(const avl_window_t *window, double q) {
+	void *item;
+
+	avl_window_quantiles(window, &q, 1, &item);
+	return item;
+}
+#endif